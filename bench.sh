@@ -0,0 +1,72 @@
+#!/bin/bash
+
+# Runs each workload several times and prints the best wall time in milliseconds.
+# The heap size can be set per workload, MINILISP_BENCH_RUNS sets the number of runs.
+
+RUNS=${MINILISP_BENCH_RUNS:-5}
+
+function bench() {
+  local best=
+  for ((i = 0; i < RUNS; i++)); do
+    local start=$(date +%s%N)
+    local error=$(echo "$3" | MINILISP_HEAP_SIZE=$2 ./repl 2>&1 > /dev/null)
+    local elapsed=$((($(date +%s%N) - start) / 1000000))
+    if [ -n "$error" ]; then
+      echo "$1: $error" >&2
+      exit 1
+    fi
+    if [ -z "$best" ] || [ $elapsed -lt $best ]; then
+      best=$elapsed
+    fi
+  done
+  printf "%-24s %8s bytes %6d ms\n" "$1" "$2" "$best"
+}
+
+CHURN='
+(defun mk (n) (if (= n 0) () (cons n (mk (- n 1)))))
+(while (< #itr 9000) (mk 50))'
+
+FIB='
+(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+(fib 21)'
+
+LIBRARY='
+(defun mk (n) (if (= n 0) () (cons n (mk (- n 1)))))
+(define lib ())
+(while (< #itr 3000) (setq lib (cons (mk 3) lib)))
+(while (< #itr 9000) (mk 30))'
+
+# examples/nqueens.lisp, counting the solutions
+NQUEENS="
+(defmacro when (expr . body) (cons 'if (cons expr (list (cons 'progn body)))))
+(defmacro unless (expr . body) (cons 'if (cons expr (cons () body))))
+(defun any (lis pred) (when lis (cond ((pred (car lis))) (#t (any (cdr lis) pred)))))
+(defun map (lis fn) (when lis (cons (fn (car lis)) (map (cdr lis) fn))))
+(defun nth (lis n) (if (= n 0) (car lis) (nth (cdr lis) (- n 1))))
+(defun nth-tail (lis n) (if (= n 0) lis (nth-tail (cdr lis) (- n 1))))
+(defun %iota (m n) (unless (<= n m) (cons m (%iota (+ m 1) n))))
+(defun iota (n) (%iota 0 n))
+(defun make-list (len init) (unless (= len 0) (cons init (make-list (- len 1) init))))
+(defun for-each (lis fn) (when lis (fn (car lis)) (for-each (cdr lis) fn)))
+(defun make-board (size) (map (iota size) (lambda (_) (make-list size 'x))))
+(defun get (board x y) (nth (nth board x) y))
+(defun set (board x y) (setcar (nth-tail (nth board x) y) '@))
+(defun clear (board x y) (setcar (nth-tail (nth board x) y) 'x))
+(defun set? (board x y) (eq (get board x y) '@))
+(defun diag? (board n y x) (let ((z (+ y (- n x)))) (if (<= 0 z) (set? board n z))))
+(defun anti? (board n y x) (let ((z (+ y (- x n)))) (if (< z board-size) (set? board n z))))
+(defun conflict? (board x y) (any (iota x) (lambda (n) (or (set? board n y) (diag? board n y x) (anti? board n y x)))))
+(defun try (board x y) (unless (conflict? board x y) (set board x y) (%solve board (+ x 1)) (clear board x y)))
+(defun %solve (board x) (if (= x board-size) (setq solutions (+ solutions 1)) (for-each (iota board-size) (lambda (y) (try board x y)))))
+(defun solve (board) (%solve board 0) solutions)
+(define board-size 8)
+(define solutions 0)
+(define board (make-board board-size))
+(solve board)"
+
+bench churn 40000 "$CHURN"
+bench churn 4000000 "$CHURN"
+bench fib 40000 "$FIB"
+bench library 1000000 "$LIBRARY"
+bench library 4000000 "$LIBRARY"
+bench nqueens 1000000 "$NQUEENS"
@@ -15,46 +15,7 @@
 ;;; expanded form using cons and list.
 ;;;
 
-;; (progn expr ...)
-;; => ((lambda () expr ...))
-(defmacro progn (expr . rest)
-  (list (cons 'lambda (cons () (cons expr rest)))))
-
-(defun list (x . y)
-  (cons x y))
-
-(defun not (x)
-  (if x () t))
-
-;; (let1 var val body ...)
-;; => ((lambda (var) body ...) val)
-(defmacro let1 (var val . body)
-  (cons (cons 'lambda (cons (list var) body))
-	(list val)))
-
-;; (and e1 e2 ...)
-;; => (if e1 (and e2 ...))
-;; (and e1)
-;; => e1
-(defmacro and (expr . rest)
-  (if rest
-      (list 'if expr (cons 'and rest))
-    expr))
-
-;; (or e1 e2 ...)
-;; => (let1 <tmp> e1
-;;      (if <tmp> <tmp> (or e2 ...)))
-;; (or e1)
-;; => e1
-;;
-;; The reason to use the temporary variables is to avoid evaluating the
-;; arguments more than once.
-(defmacro or (expr . rest)
-  (if rest
-      (let1 var (gensym)
-	    (list 'let1 var expr
-		  (list 'if var var (cons 'or rest))))
-    expr))
+;; progn, let, cond, list, not, and, or and <= are built in.
 
 ;; (when expr body ...)
 ;; => (if expr (progn body ...))
@@ -66,14 +27,6 @@
 (defmacro unless (expr . body)
   (cons 'if (cons expr (cons () body))))
 
-;;;
-;;; Numeric operators
-;;;
-
-(defun <= (e1 e2)
-  (or (< e1 e2)
-      (= e1 e2)))
-
 ;;;
 ;;; List operators
 ;;;
@@ -83,8 +36,8 @@
 ;; returns ().
 (defun any (lis pred)
   (when lis
-    (or (pred (car lis))
-	(any (cdr lis) pred))))
+    (cond ((pred (car lis)))
+	  (#t (any (cdr lis) pred)))))
 
 ;;; Applies each element of lis to fn, and returns their return values as a list.
 (defun map (lis fn)
@@ -120,9 +73,9 @@
 
 ;; Applies fn to each element of lis.
 (defun for-each (lis fn)
-  (or (not lis)
-      (progn (fn (car lis))
-	     (for-each (cdr lis) fn))))
+  (when lis
+    (fn (car lis))
+    (for-each (cdr lis) fn)))
 
 ;;;
 ;;; N-queens solver
@@ -151,36 +104,34 @@
   (eq (get board x y) '@))
 
 ;; Print out the given board.
-(defun print (board)
-  (if (not board)
-      '$
-    (println (car board))
-    (print (cdr board))))
+(defun print-board (board)
+  (dolist (row board '$)
+    (print row)))
 
 ;; Returns true if we cannot place a queen at position (x, y), assuming that
 ;; queens have already been placed on each row from 0 to x-1.
 (defun conflict? (board x y)
   (any (iota x)
        (lambda (n)
-	 (or
-	  ;; Check if there's no conflicting queen upward
-	  (set? board n y)
-	  ;; Upper left
-	  (let1 z (+ y (- n x))
-		(and (<= 0 z)
-		     (set? board n z)))
-	  ;; Upper right
-	  (let1 z (+ y (- x n))
-		(and (< z board-size)
-		     (set? board n z)))))))
+	 (let ((left (+ y (- n x)))
+	       (right (+ y (- x n))))
+	   (cond
+	    ;; Check if there's no conflicting queen upward
+	    ((set? board n y))
+	    ;; Upper left
+	    ((if (<= 0 left)
+		 (set? board n left)))
+	    ;; Upper right
+	    ((if (< right board-size)
+		 (set? board n right))))))))
 
 ;; Find positions where we can place queens at row x, and continue searching for
 ;; the next row.
 (defun %solve (board x)
   (if (= x board-size)
       ;; Problem solved
-      (progn (print board)
-	     (println '$))
+      (progn (print-board board)
+	     (print '$))
     (for-each (iota board-size)
 	      (lambda (y)
 		(unless (conflict? board x y)
@@ -189,9 +140,9 @@
 		  (clear board x y))))))
 
 (defun solve (board)
-  (println 'start)
+  (print 'start)
   (%solve board 0)
-  (println 'done))
+  (print 'done))
 
 ;;;
 ;;; Main
@@ -22,6 +22,10 @@
 #define ANSI_COLOR_GREEN "\x1b[32m"
 #define ANSI_COLOR_RESET "\x1b[0m"
 
+#define HEAP_SIZE 40000
+
+static char heap[LISP_BUFFER_SIZE(HEAP_SIZE)];
+
 void *env_constructor[3];
 void *root = NULL;
 Obj **genv;
@@ -36,23 +40,45 @@ void printErr(const char *msg, int size)
   fprintf(stderr, ANSI_COLOR_RED "%s\n" ANSI_COLOR_RESET, msg);
 }
 
+static bool getEnvFlag(const char *name)
+{
+  char *val = getenv(name);
+  return val && val[0];
+}
+
 int main()
 {
+  always_gc = getEnvFlag("MINILISP_ALWAYS_GC");
+  lisp_set_compile(getEnvFlag("MINILISP_COMPILE"));
+
   lisp_set_printers(printOut, NULL, printErr);
 
+  char *gc_budget = getenv("MINILISP_GC_BUDGET");
+  if (gc_budget)
+    lisp_set_gc_budget(strtoul(gc_budget, NULL, 10));
+
   env_constructor[0] = root;
   env_constructor[1] = NULL;
   env_constructor[2] = ROOT_END;
   root = env_constructor;
   genv = (Obj **)(env_constructor + 1);
 
-  lisp_create(40000);
+  char *heap_size = getenv("MINILISP_HEAP_SIZE");
+  char *heap_max_size = getenv("MINILISP_HEAP_MAX_SIZE");
+  if (heap_size || heap_max_size)
+  {
+    size_t size = heap_size ? atoi(heap_size) : HEAP_SIZE;
+    lisp_create(size, heap_max_size ? atoi(heap_max_size) : size);
+  }
+  else
+    lisp_create_with_buffer(heap, sizeof(heap));
 
   *genv = make_env(root, &Nil, &Nil);
   define_constants(root, genv);
   define_primitives(root, genv);
   Obj *VERSION = make_int(root, 10204); // Represents the version 1.2.3
   add_constant(root, genv, "#version", &VERSION);
+  lisp_seal(root);
 
   // lisp_eval(root, genv, "(define a 5) (setq a 1) (print #itr) (print #t) (setq #itr 1)");
   // lisp_eval(root, genv, "(print #itr) (while (< #itr 10) (print #itr)) (print #itr)");
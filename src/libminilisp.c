@@ -20,12 +20,21 @@
 #include "libminilisp.h"
 #include "memcheck.h"
 
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+
 // TODO: add comments ------------------------------------------------------
 size_t MEMORY_SIZE = 4000; // default value
 
 static bool cycle_in_progress = false;
+// The number of loops running, and of the iterations made since the outermost one started
+static int loop_depth = 0;
+static int loop_iterations = 0;
+static bool compile_forms = false;
 
 static yield_def cycle_yield = NULL;
+static timer_def timer = NULL;
 static print_def print_out = NULL;
 static print_def print_log = NULL;
 static print_def print_err = NULL;
@@ -56,7 +65,9 @@ static int printf_to_handler(char* dest, int pos, const char *fmt, ...)
     int size = 0;
 
     if (dest) {
-        size = pos + vsprintf(dest + pos, fmt, args);
+        // The buffers printed to hold SYMBOL_MAX_LEN bytes, a longer output is cut.
+        int n = pos < SYMBOL_MAX_LEN - 1 ? vsnprintf(dest + pos, SYMBOL_MAX_LEN - pos, fmt, args) : 0;
+        size = pos + n < SYMBOL_MAX_LEN - 1 ? pos + n : SYMBOL_MAX_LEN - 1;
     } else if (print_out) {
         char buf[SYMBOL_MAX_LEN];
         size = vsprintf(buf, fmt, args);
@@ -96,6 +107,7 @@ static void vsprintf_error_to_handler(const char *fmt, va_list ap)
 
 void __attribute((noreturn)) error(const char *fmt, ...) {
     cycle_in_progress = false;
+    loop_depth = 0;
 
     va_list ap;
     va_start(ap, fmt);
@@ -116,10 +128,28 @@ Obj *Nil = &literals[1];
 Obj *Dot = &literals[2];
 Obj *Cparen = &literals[3];
 
-// The list containing all symbols. Such data structure is traditionally called the "obarray", but I
-// avoid using it as a variable name as this is not an array but a list.
+// The number of constants
+#define NUM_LITERALS (sizeof(literals) / sizeof(literals[0]))
+
+// The table of the interned symbols. Such data structure is traditionally called the "obarray". It
+// is an open-addressing hash table indexed by the hash of the symbol name, so the slot of a symbol
+// does not depend on its address and stays the same when GC moves the symbol.
+static Obj *symbol_table[LISP_SYMBOL_TABLE_SIZE];
+
+// The number of symbols in the table
+static int symbol_count = 0;
+
+// True if a symbol has been added to the table since the last collection. Otherwise none of them is
+// in the nursery, and a minor collection does not need to look at the table.
+static bool symbols_added = false;
+
+// The list containing the symbols that did not fit in the table
 static Obj *Symbols;
 
+// The global environment, i.e. the first one without a parent a variable has been added to. Its
+// bindings are also kept in the symbols, so that find() does not have to search for them.
+static Obj *Globals;
+
 //======================================================================
 // Memory management
 //======================================================================
@@ -127,12 +157,107 @@ static Obj *Symbols;
 // The pointer pointing to the beginning of the current heap
 static void *memory = NULL;
 
+#if LISP_COMPACT_REFS
+// The address the compact references are relative to. The copies of the constants are kept there.
+uint8_t *lisp_heap_base = NULL;
+#endif
+
 // The pointer pointing to the beginning of the old heap
 static void *from_space = NULL;
 
+// The other semi-space. GC copies the live objects there and swaps it with the current heap.
+void *spare_space = NULL;
+
+// The block of memory both semi-spaces and the nursery are carved from. It is reserved once by
+// lisp_create(), or supplied by the caller of lisp_create_with_buffer().
+static void *heap_block = NULL;
+
+// True if heap_block has been allocated by lisp_create() and has to be freed
+static bool heap_block_owned = false;
+
+// The range the size of the heap may vary in. The heap is growable if the maximum is larger.
+static size_t min_memory_size = 0;
+static size_t max_memory_size = 0;
+
+// The sealed region at the beginning of the block. It holds the objects moved there by lisp_seal().
+// These objects are never moved, copied or freed, and are scanned only if they are in the
+// remembered set.
+static uint8_t *sealed_space = NULL;
+
+// The size of the sealed region in bytes
+static size_t sealed_size = 0;
+
 // The number of bytes allocated from the heap
 static size_t mem_nused = 0;
 
+// The nursery, i.e. the young generation. New objects are allocated here and are moved to the heap
+// above once they survive a collection.
+static void *nursery = NULL;
+
+// The size of the nursery in bytes
+static size_t nursery_size = 0;
+
+// The number of bytes allocated from the nursery
+static size_t nursery_nused = 0;
+
+// The remembered set. It lists the objects of the old generation that may hold a pointer to an
+// object in the nursery, and the sealed objects that may hold a pointer to the heap. Such objects
+// are scanned as roots by a collection. The sealed ones stay in the set for good.
+static Obj *remembered[REMEMBERED_SET_SIZE];
+static int remembered_count = 0;
+
+// If the remembered set has overflowed, the next collection has to be a major one.
+static bool remembered_overflow = false;
+
+// If a sealed object did not fit in the remembered set, every collection scans the whole sealed
+// region instead, until the next major collection lists them again, see remember_sealed().
+static bool sealed_overflow = false;
+
+// The number of collections that have moved objects. The tables hashing keys by address are
+// rehashed when it changes, see table_arg().
+static uint32_t gc_epoch = 0;
+
+#if LISP_MARK_COMPACT
+// The mark bitmap of a mark-compact collection. There is a bit per Ref-sized word of the heap and the
+// nursery, which follows the heap directly. All the words a live object takes are marked.
+static uint32_t *mark_bits = NULL;
+
+// The number of words of the mark bitmap
+static size_t mark_words = 0;
+
+// The forwarding table. For every word of the mark bitmap, it holds the offset from the beginning of
+// the heap the first marked object of the word is moved to. The objects that follow are moved right
+// after, so the new address of every live object can be worked out from the table and the bitmap.
+static size_t *forwarding = NULL;
+
+// The objects that have been marked, but whose children have not been marked yet
+static Obj *mark_stack[GC_MARK_STACK_SIZE];
+static int mark_top = 0;
+
+// If the mark stack has overflowed, the heap has to be scanned for marked objects with unmarked
+// children.
+static bool mark_overflow = false;
+#endif
+
+#if LISP_INCREMENTAL_GC
+// True while an incremental collection is in progress
+bool incremental_gc_running = false;
+
+// The longest time in microseconds a step of an incremental collection may take. Zero disables the
+// incremental collection.
+static unsigned long gc_pause_budget = 0;
+
+// The number of bytes of the from-space that have not been copied yet, live or not. The to-space
+// always keeps that much room, so that the collection cannot run out of memory halfway through.
+static size_t uncopied = 0;
+#endif
+
+// The stack of GC roots, see ADD_ROOT()
+void *lisp_root_stack[LISP_ROOT_STACK_SIZE];
+
+// The statistics reported by lisp_gc_stats()
+static GcStats stats;
+
 // Flags to debug GC
 bool gc_running = false;
 bool debug_gc = false;
@@ -155,6 +280,36 @@ bool always_gc = false;
 // Be careful not to bypass the two levels of pointer indirections. If you create a direct pointer
 // to an object, it'll cause a subtle bug. Such code would work in most cases but fails with SEGV if
 // GC happens during the execution of the code. Any code that allocates memory may invoke GC.
+//
+// On top of that the heap is split into two generations. Most of the objects die young, while the
+// environment, the primitives and the user library live as long as the interpreter does. New
+// objects are therefore allocated in a small nursery. When the nursery is full, a minor collection
+// moves the survivors to the end of the heap (i.e. promotes them to the old generation) and leaves
+// the old objects in place. Only when the old generation itself fills up, a major collection
+// copies both generations to the other semi-space as described above.
+//
+// A minor collection does not scan the old generation, so it has to know about every pointer from
+// an old object to a young one. Such pointers can only be created by mutating an existing object,
+// and every such mutation must go through write_barrier(), which adds the mutated object to the
+// remembered set.
+//
+// The objects that live as long as the interpreter can be moved out of the way for good by
+// lisp_seal(). They end up in the sealed region below the semi-spaces, which no collection copies or
+// scans. The write barrier treats a sealed object pointing to the heap the same way as an old
+// object pointing to the nursery.
+//
+// If LISP_MARK_COMPACT is set, there is no second semi-space. A major collection marks the live
+// objects of both generations in a bitmap, then slides them towards the beginning of the heap and
+// updates the pointers to them. This takes several passes over the heap, but the heap only needs a
+// few percent of extra memory instead of a copy of itself. Minor collections are the same.
+//
+// If LISP_INCREMENTAL_GC is set and a pause budget is given, a major collection does not copy
+// everything at once. It only copies the roots to the to-space, then the interpreter goes on. Each
+// allocation scans a few objects of the to-space, and so does lisp_gc_step() for as long as the
+// budget allows. Meanwhile the objects are allocated in the to-space directly and the nursery is
+// not used. An object that is read from the from-space through CAR() and friends is copied to the
+// to-space first (Baker's read barrier), so the interpreter only ever holds references to the
+// to-space and never stores a reference to the from-space anywhere.
 
 // Round up the given value to a multiple of size. Size must be a power of 2. It adds size - 1
 // first, then zero-ing the least significant bits to make the result a multiple of size. I know
@@ -163,19 +318,124 @@ static inline size_t roundup(size_t var, size_t size) {
     return (var + size - 1) & ~(size - 1);
 }
 
-// Allocates memory block. This may start GC if we don't have enough memory.
-static Obj *alloc(void *root, int type, size_t size) {
-    // The object must be large enough to contain a pointer for the forwarding pointer. Make it
+static inline bool is_young(Obj *obj) {
+    return (size_t)((uint8_t *)obj - (uint8_t *)nursery) < nursery_size;
+}
+
+static inline bool is_old(Obj *obj) {
+    return (size_t)((uint8_t *)obj - (uint8_t *)memory) < MEMORY_SIZE;
+}
+
+static inline bool is_sealed(Obj *obj) {
+    return (size_t)((uint8_t *)obj - sealed_space) < sealed_size;
+}
+
+// Returns true if the pointer refers to one of the constants or to the live part of the heap.
+static bool is_lisp_object(Obj *obj) {
+    if (is_fixnum(obj))
+        return true;
+    if (obj >= True && obj < True + NUM_LITERALS)
+        return true;
+    if (is_young(obj))
+        return (size_t)((uint8_t *)obj - (uint8_t *)nursery) < nursery_nused;
+    return is_sealed(obj) || (is_old(obj) && (size_t)((uint8_t *)obj - (uint8_t *)memory) < mem_nused);
+}
+
+static void remember(Obj *obj) {
+    if (obj->flags & FLAG_REMEMBERED)
+        return;
+    if (remembered_count == REMEMBERED_SET_SIZE) {
+        if (is_sealed(obj))
+            sealed_overflow = true;
+        else
+            remembered_overflow = true;
+        return;
+    }
+    obj->flags |= FLAG_REMEMBERED;
+    remembered[remembered_count++] = obj;
+}
+
+// Must be called after storing val into a pointer field of obj, unless obj has been allocated after
+// the last allocation that could have triggered GC (i.e. it is still in the nursery).
+void write_barrier(Obj *obj, Obj *val) {
+    if (is_old(obj) ? is_young(val) : is_sealed(obj) && (is_young(val) || is_old(val)))
+        remember(obj);
+}
+
+// Returns the total size of an object with the given size of contents.
+static inline size_t object_size(size_t size) {
+    // The object must be large enough to contain a reference for the forwarding pointer. Make it
     // larger if it's smaller than that.
-    size = roundup(size, sizeof(void *));
+    size = roundup(size, sizeof(Ref));
 
     // Add the size of the type tag and size fields.
     size += offsetof(Obj, value);
 
     // Round up the object size to the nearest alignment boundary, so that the next object will be
     // allocated at the proper alignment boundary. Currently we align the object at the same
-    // boundary as the pointer.
-    size = roundup(size, sizeof(void *));
+    // boundary as the reference.
+    return roundup(size, sizeof(Ref));
+}
+
+// Returns the total size of the given object.
+static inline size_t obj_size(Obj *obj) {
+#if LISP_COMPACT_REFS
+    switch (obj->type) {
+    case TINT:
+        return object_size(sizeof(int));
+    case TSYMBOL:
+        return object_size(offsetof(Obj, name) - offsetof(Obj, value) + strlen(obj->name) + 1);
+    case TPRIMITIVE:
+        return object_size(sizeof(Primitive *));
+    case TFUNCTION:
+    case TMACRO:
+        return object_size(sizeof(Ref) * 3);
+    case TENV:
+        return object_size(offsetof(Obj, slots) - offsetof(Obj, value) + obj->nslots * sizeof(Ref));
+    case TVECTOR:
+        return object_size(offsetof(Obj, elems) - offsetof(Obj, value) + obj->nelems * sizeof(Ref));
+    case TARRAY:
+        return object_size(offsetof(Obj, ints) - offsetof(Obj, value) + obj->nelems * sizeof(int32_t));
+    case TSTRING:
+    case TBYTES:
+        return object_size(offsetof(Obj, bytes) - offsetof(Obj, value) +
+                           (obj->base == obj_to_ref(Nil) ? obj->len : 0));
+    case TTABLE:
+        return object_size(offsetof(Obj, epoch) - offsetof(Obj, value) + sizeof(uint32_t));
+    case TLOCAL:
+        return object_size(offsetof(Obj, slot) - offsetof(Obj, value) + sizeof(uint16_t));
+    case TNODE:
+        return object_size(offsetof(Obj, handler) - offsetof(Obj, value) + sizeof(Primitive *));
+    case TCODE:
+        return object_size(offsetof(Obj, consts) - offsetof(Obj, value) + obj->nconsts * sizeof(Ref) + obj->nbytes);
+    default:
+        return object_size(sizeof(Ref) * 2);
+    }
+#else
+    return obj->size;
+#endif
+}
+
+static void collect(void *root, size_t size);
+static void resize_heap(void *root, size_t size);
+#if LISP_INCREMENTAL_GC
+static Obj *scan2;
+static void incremental_gc_step(size_t bytes);
+#endif
+
+// Allocates memory block. This may start GC if we don't have enough memory.
+static Obj *alloc(void *root, int type, size_t size) {
+    size = object_size(size);
+
+#if LISP_INCREMENTAL_GC
+    // Every allocation made during an incremental collection does its share of the work.
+    if (incremental_gc_running)
+        incremental_gc_step(size * GC_INCREMENT_RATIO);
+#endif
+
+    // Objects that would take a large part of the nursery are allocated in the old generation
+    // directly. Copying them around would be expensive and they would flush the nursery anyway.
+    bool pretenure = size > nursery_size / GC_PRETENURE_RATIO;
 
     // If the debug flag is on, allocate a new memory space to force all the existing objects to
     // move to new addresses, to invalidate the old addresses. By doing this the GC behavior becomes
@@ -185,21 +445,63 @@ static Obj *alloc(void *root, int type, size_t size) {
     if (always_gc && !gc_running)
         gc(root);
 
-    // Otherwise, run GC only when the available memory is not large enough.
-    if (!always_gc && MEMORY_SIZE < mem_nused + size)
-        gc(root);
-
-    // Terminate the program if we couldn't satisfy the memory request. This can happen if the
-    // requested size was too large or the from-space was filled with too many live objects.
-    if (MEMORY_SIZE < mem_nused + size)
+    // Otherwise, run GC only when the available memory is not large enough. The heap must always
+    // have enough room to take everything in the nursery, so that a collection cannot run out of
+    // memory halfway through.
+    if (!always_gc && (MEMORY_SIZE < mem_nused + nursery_nused + size ||
+                       (!pretenure && nursery_size < nursery_nused + size)))
+        collect(root, size);
+
+#if LISP_INCREMENTAL_GC
+    // If the to-space of an incremental collection, which may have just started, is about to fill
+    // up, the collection has to be finished right away.
+    if (incremental_gc_running && MEMORY_SIZE < mem_nused + uncopied + size)
+        incremental_gc_step(SIZE_MAX);
+    pretenure = pretenure || incremental_gc_running;
+#endif
+
+    // Terminate the program if we couldn't satisfy the memory request, even by growing the heap.
+    // This can happen if the requested size was too large or the from-space was filled with too
+    // many live objects.
+    if (MEMORY_SIZE < mem_nused + nursery_nused + size)
+        resize_heap(root, size);
+    if (MEMORY_SIZE < mem_nused + nursery_nused + size)
         error("Memory exhausted");
 
     // Allocate the object.
-    Obj *obj = (Obj *)((char *)memory + mem_nused);
+    Obj *obj;
+    if (pretenure) {
+        obj = (Obj *)((char *)memory + mem_nused);
+        mem_nused += size;
+#if LISP_INCREMENTAL_GC
+        if (incremental_gc_running)
+            scan2 = (Obj *)((uint8_t *)memory + mem_nused);
+#endif
+    } else {
+        obj = (Obj *)((char *)nursery + nursery_nused);
+        nursery_nused += size;
+    }
     obj->type = type;
+#if !LISP_COMPACT_REFS
     obj->size = size;
+#endif
     obj->constant = false;
-    mem_nused += size;
+    obj->flags = 0;
+
+    stats.bytes_allocated[type] += size;
+    size_t used = lisp_mem_used();
+    if (stats.high_water < used)
+        stats.high_water = used;
+
+    // The constructor is about to fill in the fields of the object, and these may point to the
+    // nursery. There is no nursery during an incremental collection.
+#if LISP_INCREMENTAL_GC
+    if (pretenure && !incremental_gc_running)
+        remember(obj);
+#else
+    if (pretenure)
+        remember(obj);
+#endif
     return obj;
 }
 
@@ -214,121 +516,663 @@ static Obj *alloc(void *root, int type, size_t size) {
 static Obj *scan1;
 static Obj *scan2;
 
+// True while a major collection is running. A minor collection leaves the old generation alone.
+static bool major_gc_running = false;
+
+// While the heap is being resized, the sealed region is moved by the given number of bytes.
+static uint8_t *relocated_space = NULL;
+static size_t relocated_size = 0;
+static ptrdiff_t relocation = 0;
+
+// Returns the current time in microseconds. The timer set by lisp_set_timer() is used if any.
+static unsigned long time_us(void) {
+    if (timer)
+        return timer();
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    return (unsigned long)((uint64_t)clock() * 1000000 / CLOCKS_PER_SEC);
+#endif
+}
+
+// Accounts for the pause of a collection started at the given time.
+static void record_pause(unsigned long start) {
+    unsigned long pause = time_us() - start;
+    stats.total_pause += pause;
+    if (stats.max_pause < pause)
+        stats.max_pause = pause;
+}
+
 // Moves one object from the from-space to the to-space. Returns the object's new address. If the
 // object has already been moved, does nothing but just returns the new address.
 static inline Obj *forward(Obj *obj) {
+    // Immediate values are not objects.
+    if (is_fixnum(obj))
+        return obj;
+
+    // The sealed objects are moved along with the rest of the heap when it is resized.
+    if ((size_t)((uint8_t *)obj - relocated_space) < relocated_size)
+        return (Obj *)((uint8_t *)obj + relocation);
+
     // If the object's address is not in the from-space, the object is not managed by GC nor it
-    // has already been moved to the to-space.
+    // has already been moved to the to-space. The nursery is evacuated by every collection, the
+    // old generation only by a major one.
     ptrdiff_t offset = (uint8_t *)obj - (uint8_t *)from_space;
-    if (offset < 0 || MEMORY_SIZE <= (size_t)offset)
+    if (!is_young(obj) && (!major_gc_running || offset < 0 || MEMORY_SIZE <= (size_t)offset))
         return obj;
 
     // The pointer is pointing to the from-space, but the object there was a tombstone. Follow the
     // forwarding pointer to find the new location of the object.
     if (obj->type == TMOVED)
-        return (Obj *)obj->moved;
+        return MOVED(obj);
 
     // Otherwise, the object has not been moved yet. Move it.
     Obj *newloc = scan2;
-    memcpy(newloc, obj, obj->size);
-    scan2 = (Obj *)((uint8_t *)scan2 + obj->size);
+    size_t size = obj_size(obj);
+#if LISP_INCREMENTAL_GC
+    if (incremental_gc_running) {
+        assert((uint8_t *)scan2 + size <= (uint8_t *)memory + MEMORY_SIZE);
+        uncopied -= size;
+    }
+#endif
+    memcpy(newloc, obj, size);
+    newloc->flags &= ~FLAG_REMEMBERED;
+    scan2 = (Obj *)((uint8_t *)scan2 + size);
+    stats.bytes_copied += size;
 
     // Put a tombstone at the location where the object used to occupy, so that the following call
     // of forward() can find the object's new location.
     obj->type = TMOVED;
-    obj->moved = newloc;
+    SET_MOVED(obj, newloc);
     return newloc;
 }
 
-static void *alloc_semispace() {
-    return malloc(MEMORY_SIZE);
+static inline bool is_on_root_stack(void *root) {
+    return (size_t)((uint8_t *)root - (uint8_t *)lisp_root_stack) <= sizeof(lisp_root_stack);
 }
 
-// Copies the root objects.
-static void forward_root_objects(void *root) {
-    Symbols = forward(Symbols);
-    for (void **frame = (void **)root; frame; frame = *(void ***)frame)
+void **lisp_enter_roots(void *root) {
+    if (is_on_root_stack(root))
+        error("Root stack overflow");
+    lisp_root_stack[0] = root;
+    return lisp_root_stack + 1;
+}
+
+// Replaces every root with the result of the given function, e.g. forward(). The roots are the
+// symbols, the slots of the root stack below the given root, and the ones in the frames built by
+// hand.
+static inline void scan_roots(void *root, Obj *(*fn)(Obj *)) {
+    Symbols = fn(Symbols);
+    Globals = fn(Globals);
+    if (major_gc_running || symbols_added)
+        for (int i = 0; i < LISP_SYMBOL_TABLE_SIZE; i++)
+            if (symbol_table[i])
+                symbol_table[i] = fn(symbol_table[i]);
+    symbols_added = false;
+    void **frame = (void **)root;
+    if (is_on_root_stack(root)) {
+        for (void **p = lisp_root_stack + 1; p < (void **)root; p++)
+            if (*p)
+                *p = fn((Obj *)*p);
+        frame = (void **)lisp_root_stack[0];
+    }
+    for (; frame; frame = *(void ***)frame)
         for (int i = 1; frame[i] != ROOT_END; i++)
             if (frame[i])
-                frame[i] = forward((Obj *)frame[i]);
+                frame[i] = fn((Obj *)frame[i]);
+}
+
+// Replaces every pointer the given object holds with the result of the given function.
+static inline void scan_object_with(Obj *obj, Obj *(*fn)(Obj *)) {
+    switch (obj->type) {
+    case TINT:
+    case TPRIMITIVE:
+    case TARRAY:
+        // Any of the above types does not contain a pointer to a GC-managed object.
+        break;
+    case TSYMBOL:
+        SET_GLOBAL(obj, fn(ref_to_obj(obj->global)));
+        break;
+    case TCELL:
+        // The cdr goes first, so that the mark stack does not grow with the length of a list.
+        SET_CDR(obj, fn(ref_to_obj(obj->cdr)));
+        SET_CAR(obj, fn(ref_to_obj(obj->car)));
+        break;
+    case TFUNCTION:
+    case TMACRO:
+        SET_PARAMS(obj, fn(ref_to_obj(obj->params)));
+        SET_BODY(obj, fn(ref_to_obj(obj->body)));
+        SET_ENV(obj, fn(ref_to_obj(obj->env)));
+        break;
+    case TENV:
+        SET_UP(obj, fn(ref_to_obj(obj->up)));
+        SET_VARS(obj, fn(ref_to_obj(obj->vars)));
+        SET_NAMES(obj, fn(ref_to_obj(obj->names)));
+        for (int i = 0; i < obj->nslots; i++)
+            SET_SLOT(obj, i, fn(ref_to_obj(obj->slots[i])));
+        break;
+    case TVECTOR:
+        for (int i = 0; i < obj->nelems; i++)
+            SET_ELEM(obj, i, fn(ref_to_obj(obj->elems[i])));
+        break;
+    case TSTRING:
+    case TBYTES:
+        SET_BASE(obj, fn(ref_to_obj(obj->base)));
+        break;
+    case TTABLE:
+        SET_ENTRIES(obj, fn(ref_to_obj(obj->entries)));
+        break;
+    case TLOCAL:
+        SET_VAR(obj, fn(ref_to_obj(obj->var)));
+        SET_BINDER(obj, fn(ref_to_obj(obj->binder)));
+        break;
+    case TNODE:
+        SET_FORM(obj, fn(ref_to_obj(obj->form)));
+        break;
+    case TCODE:
+        for (int i = 0; i < obj->nconsts; i++)
+            SET_CODE_CONST(obj, i, fn(ref_to_obj(obj->consts[i])));
+        break;
+    default:
+        error("Bug: copy: unknown type %d", obj->type);
+    }
+}
+
+// Copies the root objects.
+static void forward_root_objects(void *root) {
+    scan_roots(root, forward);
+}
+
+// Forwards the pointers the given object holds.
+static void scan_object(Obj *obj) {
+    scan_object_with(obj, forward);
+}
+
+// Copies the objects referenced by the objects located between scan1 and scan2. Once it's
+// finished, all live objects (i.e. objects reachable from the root) will have been copied to the
+// to-space.
+static void scan_copied_objects(void) {
+    while (scan1 < scan2) {
+        scan_object(scan1);
+        scan1 = (Obj *)((uint8_t *)scan1 + obj_size(scan1));
+    }
+}
+
+// Passes the pointers held by the remembered objects to the given function. The old ones are
+// skipped by a major collection, which scans them after they have been copied anyway.
+static void scan_remembered(bool major, Obj *(*fn)(Obj *)) {
+    for (int i = 0; i < remembered_count; i++)
+        if (!major || is_sealed(remembered[i]))
+            scan_object_with(remembered[i], fn);
+    if (sealed_overflow)
+        for (uint8_t *p = sealed_space; p < sealed_space + sealed_size; p += obj_size((Obj *)p))
+            scan_object_with((Obj *)p, fn);
+}
+
+// Empties the remembered set, except for the sealed objects. These keep pointing to the heap, and
+// only the remembered set tells the collector about them.
+static void forget_remembered(void) {
+    int n = 0;
+    for (int i = 0; i < remembered_count; i++) {
+        Obj *obj = remembered[i];
+        if (!is_sealed(obj))
+            obj->flags &= ~FLAG_REMEMBERED;
+        else if (!sealed_overflow)
+            remembered[n++] = obj;
+    }
+    remembered_count = n;
+    remembered_overflow = false;
+}
+
+static bool heap_ref_found;
+
+static Obj *find_heap_ref(Obj *obj) {
+    if (!is_fixnum(obj) && !is_sealed(obj) && (is_old(obj) || is_young(obj)))
+        heap_ref_found = true;
+    return obj;
+}
+
+// Lists the sealed objects pointing to the heap in the remembered set again, after a major
+// collection has scanned the whole sealed region because they did not fit. They fit again once
+// enough of them have stopped pointing to the heap, and the collections go back to scanning only
+// them.
+static void remember_sealed(void) {
+    if (!sealed_overflow)
+        return;
+    sealed_overflow = false;
+    for (uint8_t *p = sealed_space; p < sealed_space + sealed_size; p += obj_size((Obj *)p)) {
+        Obj *obj = (Obj *)p;
+        obj->flags &= ~FLAG_REMEMBERED;
+        heap_ref_found = false;
+        scan_object_with(obj, find_heap_ref);
+        if (heap_ref_found)
+            remember(obj);
+    }
+}
+
+// Promotes the live objects of the nursery to the old generation. The heap is known to have enough
+// room for the whole nursery, see alloc().
+static void minor_gc(void *root) {
+    assert(!gc_running);
+    gc_running = true;
+    unsigned long start = time_us();
+
+    // The survivors are appended to the old generation, so the to-space is the free part of the
+    // current heap.
+    scan1 = scan2 = (Obj *)((uint8_t *)memory + mem_nused);
+
+    // The roots of a minor collection are the regular roots plus the old objects pointing to the
+    // nursery.
+    forward_root_objects(root);
+    scan_remembered(false, forward);
+    forget_remembered();
+
+    scan_copied_objects();
+
+    // Finish up GC.
+    size_t promoted = (size_t)((uint8_t *)scan1 - (uint8_t *)memory) - mem_nused;
+    if (debug_gc)
+        printf_to_handler(NULL, 0, "GC: %zu bytes out of %zu bytes promoted.\n", promoted, nursery_nused);
+    mem_nused += promoted;
+    nursery_nused = 0;
+    stats.minor_collections++;
+    gc_epoch++;
+    record_pause(start);
+    gc_running = false;
 }
 
-// Implements Cheney's copying garbage collection algorithm.
+#if LISP_MARK_COMPACT
+// Returns true if the object is in the heap or the nursery, which directly follows the heap in this
+// mode, i.e. if a major collection may move it.
+static inline bool is_compactable(Obj *obj) {
+    return !is_fixnum(obj) && (size_t)((uint8_t *)obj - (uint8_t *)memory) < MEMORY_SIZE + nursery_size;
+}
+
+// Returns the index of the bit of the mark bitmap for the first word of the object.
+static inline size_t mark_index(Obj *obj) {
+    return (size_t)((uint8_t *)obj - (uint8_t *)memory) / sizeof(Ref);
+}
+
+static inline bool is_marked(Obj *obj) {
+    size_t i = mark_index(obj);
+    return mark_bits[i / 32] & (1u << (i % 32));
+}
+
+// Marks every word of the object, and pushes it to the mark stack so that its children get marked
+// too. Returns the object as it is.
+static Obj *mark(Obj *obj) {
+    if (!is_compactable(obj) || is_marked(obj))
+        return obj;
+    for (size_t i = mark_index(obj), end = i + obj_size(obj) / sizeof(Ref); i < end; i++)
+        mark_bits[i / 32] |= 1u << (i % 32);
+    if (mark_top < GC_MARK_STACK_SIZE)
+        mark_stack[mark_top++] = obj;
+    else
+        mark_overflow = true;
+    return obj;
+}
+
+// Marks everything reachable from the objects on the mark stack.
+static void mark_children(void) {
+    while (mark_top > 0)
+        scan_object_with(mark_stack[--mark_top], mark);
+}
+
+static void remark_object(Obj *obj) {
+    scan_object_with(obj, mark);
+    mark_children();
+}
+
+// Calls the function for every marked object between the given addresses. The size of the object
+// is read first, so the function may move it.
+static void walk_marked(uint8_t *p, uint8_t *end, void (*fn)(Obj *)) {
+    while (p < end) {
+        Obj *obj = (Obj *)p;
+        p += obj_size(obj);
+        if (is_marked(obj))
+            fn(obj);
+    }
+}
+
+// Calls the function for every marked object of the heap and the nursery, in the order of their
+// addresses.
+static void for_each_marked(void (*fn)(Obj *)) {
+    walk_marked(memory, (uint8_t *)memory + mem_nused, fn);
+    walk_marked(nursery, (uint8_t *)nursery + nursery_nused, fn);
+}
+
+// Fills in the forwarding table. Every live object is going to be moved down by the number of
+// unmarked words below it. Returns the total size of the live objects.
+static size_t compute_forwarding(void) {
+    size_t offset = 0;
+    for (size_t i = 0; i < mark_words; i++) {
+        forwarding[i] = offset;
+        offset += __builtin_popcount(mark_bits[i]) * sizeof(Ref);
+    }
+    return offset;
+}
+
+// Returns the address a live object is going to be moved to.
+static Obj *forwarding_address(Obj *obj) {
+    if (!is_compactable(obj))
+        return obj;
+    size_t i = mark_index(obj);
+    uint32_t below = mark_bits[i / 32] & ((1u << (i % 32)) - 1);
+    return (Obj *)((uint8_t *)memory + forwarding[i / 32] + __builtin_popcount(below) * sizeof(Ref));
+}
+
+static void update_object(Obj *obj) {
+    scan_object_with(obj, forwarding_address);
+}
+
+static void slide_object(Obj *obj) {
+    Obj *newloc = forwarding_address(obj);
+    if (newloc != obj) {
+        size_t size = obj_size(obj);
+        memmove(newloc, obj, size);
+        stats.bytes_copied += size;
+    }
+}
+
+// Implements the LISP2 sliding mark-compact algorithm, with the forwarding addresses kept in a
+// table on the side instead of in the objects. Both generations are collected, the survivors end up
+// at the beginning of the heap in the same order.
+// https://en.wikipedia.org/wiki/Mark%E2%80%93compact_algorithm
+static void mark_compact(void *root) {
+    // Mark everything reachable from the roots. If the mark stack overflows, the marked objects
+    // are scanned again until nothing is left behind.
+    memset(mark_bits, 0, mark_words * sizeof(uint32_t));
+    scan_roots(root, mark);
+    scan_remembered(true, mark);
+    mark_children();
+    while (mark_overflow) {
+        mark_overflow = false;
+        for_each_marked(remark_object);
+    }
+
+    // Point every reference to the new addresses, while the objects are still in place.
+    size_t live = compute_forwarding();
+    scan_roots(root, forwarding_address);
+    scan_remembered(true, forwarding_address);
+    for_each_marked(update_object);
+    forget_remembered();
+
+    // Slide the live objects down. They only ever move towards the beginning of the heap, so an
+    // object never overwrites one that has not been moved yet.
+    for_each_marked(slide_object);
+    mem_nused = live;
+}
+#endif
+
+// Collects both generations. The survivors end up in the old generation. Unless LISP_MARK_COMPACT
+// is set, this implements Cheney's copying garbage collection algorithm.
 // http://en.wikipedia.org/wiki/Cheney%27s_algorithm
 void gc(void *root) {
+#if LISP_INCREMENTAL_GC
+    if (incremental_gc_running)
+        incremental_gc_step(SIZE_MAX);
+#endif
     assert(!gc_running);
     gc_running = true;
-
-    // Allocate a new semi-space.
+    major_gc_running = true;
+    unsigned long start = time_us();
+    size_t old_nused = mem_nused + nursery_nused;
+
+#if LISP_MARK_COMPACT
+    mark_compact(root);
+#else
+    // Flip the semi-spaces.
     from_space = memory;
-    memory = alloc_semispace();
+    memory = spare_space;
 
     // Initialize the two pointers for GC. Initially they point to the beginning of the to-space.
     scan1 = scan2 = (Obj *)memory;
 
-    // Copy the GC root objects first. This moves the pointer scan2.
+    // Copy the GC root objects first. This moves the pointer scan2. Every old object is going to be
+    // scanned anyway, so only the sealed part of the remembered set is of use.
     forward_root_objects(root);
+    scan_remembered(true, forward);
+    forget_remembered();
 
-    // Copy the objects referenced by the GC root objects located between scan1 and scan2. Once it's
-    // finished, all live objects (i.e. objects reachable from the root) will have been copied to
-    // the to-space.
-    while (scan1 < scan2) {
-        switch (scan1->type) {
-        case TINT:
-        case TSYMBOL:
-        case TPRIMITIVE:
-            // Any of the above types does not contain a pointer to a GC-managed object.
-            break;
-        case TCELL:
-            scan1->car = forward(scan1->car);
-            scan1->cdr = forward(scan1->cdr);
-            break;
-        case TFUNCTION:
-        case TMACRO:
-            scan1->params = forward(scan1->params);
-            scan1->body = forward(scan1->body);
-            scan1->env = forward(scan1->env);
-            break;
-        case TENV:
-            scan1->vars = forward(scan1->vars);
-            scan1->up = forward(scan1->up);
-            break;
-        default:
-            error("Bug: copy: unknown type %d", scan1->type);
-        }
-        scan1 = (Obj *)((uint8_t *)scan1 + scan1->size);
-    }
+    scan_copied_objects();
+    spare_space = from_space;
+    mem_nused = (size_t)((uint8_t *)scan1 - (uint8_t *)memory);
+#endif
 
     // Finish up GC.
-    free(from_space);
+    nursery_nused = 0;
+    remember_sealed();
+    if (debug_gc)
+        printf_to_handler(NULL, 0, "GC: %zu bytes out of %zu bytes copied.\n", mem_nused, old_nused);
+    stats.major_collections++;
+    stats.live_after_gc = sealed_size + mem_nused;
+    gc_epoch++;
+    record_pause(start);
+    major_gc_running = false;
+    gc_running = false;
+
+    resize_heap(root, 0);
+}
+
+#if LISP_INCREMENTAL_GC
+// Starts an incremental collection. The nursery has to be empty. Only the roots are copied to the
+// to-space, the rest is left to incremental_gc_step().
+static void start_incremental_gc(void *root) {
+    assert(!gc_running && nursery_nused == 0);
+    gc_running = true;
+    major_gc_running = true;
+    unsigned long start = time_us();
+
+    // Flip the semi-spaces. The from-space becomes the spare one right away, so that the read
+    // barrier can tell the objects that have not been copied yet.
+    from_space = memory;
+    memory = spare_space;
+    spare_space = from_space;
     size_t old_nused = mem_nused;
+
+    scan1 = scan2 = (Obj *)memory;
+    forward_root_objects(root);
+    scan_remembered(true, forward);
+    forget_remembered();
+    mem_nused = (size_t)((uint8_t *)scan2 - (uint8_t *)memory);
+    uncopied = old_nused - mem_nused;
+
+    incremental_gc_running = true;
+    record_pause(start);
+    gc_running = false;
+}
+
+// Scans the given number of bytes of the to-space, or less if the collection is over sooner.
+static void incremental_scan(size_t bytes) {
+    uint8_t *end = (uint8_t *)scan1 + (bytes < MEMORY_SIZE ? bytes : MEMORY_SIZE);
+    while (scan1 < scan2 && (uint8_t *)scan1 < end) {
+        scan_object(scan1);
+        scan1 = (Obj *)((uint8_t *)scan1 + obj_size(scan1));
+    }
+    mem_nused = (size_t)((uint8_t *)scan2 - (uint8_t *)memory);
+
+    // Everything reachable has been copied once there is nothing left to scan.
+    if (scan1 == scan2) {
+        if (debug_gc)
+            printf_to_handler(NULL, 0, "GC: %zu bytes in use after incremental collection.\n", mem_nused);
+        incremental_gc_running = false;
+        major_gc_running = false;
+        remember_sealed();
+        stats.major_collections++;
+        stats.live_after_gc = sealed_size + mem_nused;
+        gc_epoch++;
+    }
+}
+
+static void incremental_gc_step(size_t bytes) {
+    unsigned long start = time_us();
+    incremental_scan(bytes);
+    record_pause(start);
+}
+
+// Copies an object the interpreter is about to read from the from-space. See read_barrier().
+Obj *gc_read_barrier(Obj *obj) {
+    obj = forward(obj);
+    mem_nused = (size_t)((uint8_t *)scan2 - (uint8_t *)memory);
+    return obj;
+}
+#endif
+
+// Makes room for an allocation of the given size. Runs a minor collection, which is usually enough,
+// and falls back to a major one once the old generation is about to fill up.
+static void collect(void *root, size_t size) {
+    if (!remembered_overflow)
+        minor_gc(root);
+
+#if LISP_INCREMENTAL_GC
+    // An incremental collection starts earlier, while there is enough room left for the objects
+    // allocated until it is over. These take at most a 1/(GC_INCREMENT_RATIO - 1) of the live set,
+    // on top of the copy of the whole old generation the to-space has to have room for.
+    if (gc_pause_budget && !remembered_overflow &&
+        MEMORY_SIZE / GC_INCREMENT_RATIO * (GC_INCREMENT_RATIO - 1) < mem_nused + nursery_size) {
+        start_incremental_gc(root);
+        return;
+    }
+#endif
+
+    if (remembered_overflow || MEMORY_SIZE < mem_nused + nursery_size || MEMORY_SIZE < mem_nused + size) {
+        gc(root);
+        if (MEMORY_SIZE < mem_nused + nursery_size + size)
+            resize_heap(root, size);
+    }
+}
+
+// Places the nursery and the other semi-space, or the mark-compact tables, after the heap.
+static void place_spaces(void) {
+    nursery_size = roundup(MEMORY_SIZE / GC_NURSERY_RATIO, sizeof(void *));
+#if LISP_MARK_COMPACT
+    nursery = (uint8_t *)memory + MEMORY_SIZE;
+    mark_words = (MEMORY_SIZE + nursery_size) / (32 * sizeof(Ref)) + 1;
+    forwarding = (size_t *)roundup((uintptr_t)nursery + nursery_size, sizeof(void *));
+    mark_bits = (uint32_t *)(forwarding + mark_words);
+#else
+    spare_space = (uint8_t *)memory + MEMORY_SIZE;
+    nursery = (uint8_t *)memory + 2 * MEMORY_SIZE;
+#endif
+}
+
+// Moves the heap to a new block of the given size. The sealed region is copied as it is, then the
+// live objects are copied the same way gc() does, and the pointers to the sealed objects are
+// adjusted on the way. Returns false if there is not enough memory for the new block.
+static bool move_heap(void *root, size_t size) {
+    void *block = malloc(LISP_BUFFER_SIZE(size) + sealed_size);
+    if (block == NULL)
+        return false;
+    assert(!gc_running);
+    gc_running = true;
+    major_gc_running = true;
+    unsigned long start = time_us();
+
+    uint8_t *p = (uint8_t *)roundup((uintptr_t)block, sizeof(void *));
+    memcpy(p, sealed_space, sealed_size);
+    relocated_space = sealed_space;
+    relocated_size = sealed_size;
+    relocation = p - sealed_space;
+    for (int i = 0; i < remembered_count; i++)
+        if (is_sealed(remembered[i]))
+            remembered[i] = (Obj *)((uint8_t *)remembered[i] + relocation);
+
+    // The old semi-space and nursery are the from-space now. Their bounds are needed until the copy
+    // is over.
+    from_space = memory;
+    sealed_space = p;
+    memory = p + sealed_size;
+    scan1 = scan2 = (Obj *)memory;
+
+    // Every sealed object may point to another sealed object, so the whole region is scanned.
+    forward_root_objects(root);
+    for (uint8_t *q = sealed_space; q < sealed_space + sealed_size; q += obj_size((Obj *)q))
+        scan_object((Obj *)q);
+    forget_remembered();
+    scan_copied_objects();
+
+    size_t old_nused = mem_nused + nursery_nused;
     mem_nused = (size_t)((uint8_t *)scan1 - (uint8_t *)memory);
+    nursery_nused = 0;
+    MEMORY_SIZE = size & ~(sizeof(void *) - 1);
+    place_spaces();
+    if (heap_block_owned)
+        free(heap_block);
+    heap_block = block;
+    heap_block_owned = true;
+    relocated_size = 0;
+
     if (debug_gc)
-        printf_to_handler(NULL, 0, "GC: %zu bytes out of %zu bytes copied.\n", mem_nused, old_nused);
+        printf_to_handler(NULL, 0, "GC: %zu bytes out of %zu bytes moved to a %zu bytes heap.\n", mem_nused, old_nused, MEMORY_SIZE);
+    stats.major_collections++;
+    stats.live_after_gc = sealed_size + mem_nused;
+    gc_epoch++;
+    record_pause(start);
+    major_gc_running = false;
     gc_running = false;
+    return true;
+}
+
+// Grows or shrinks a growable heap depending on how much of it has survived the last major
+// collection. An allocation of the given size is about to follow, and the heap must still be able
+// to take the whole nursery after that.
+static void resize_heap(void *root, size_t size) {
+    if (max_memory_size <= min_memory_size)
+        return;
+#if LISP_INCREMENTAL_GC
+    if (incremental_gc_running)
+        return;
+#endif
+    size_t new_size = MEMORY_SIZE;
+    if (MEMORY_SIZE * GC_GROW_PERCENT < mem_nused * 100 || MEMORY_SIZE < mem_nused + nursery_size + size) {
+        do
+            new_size *= 2;
+        while (new_size < mem_nused + new_size / GC_NURSERY_RATIO + size);
+        if (new_size > max_memory_size)
+            new_size = max_memory_size;
+    } else if (mem_nused * 100 < MEMORY_SIZE * GC_SHRINK_PERCENT && min_memory_size <= MEMORY_SIZE / 2) {
+        new_size = MEMORY_SIZE / 2;
+    }
+    if (new_size != MEMORY_SIZE)
+        move_heap(root, new_size);
 }
 
 //======================================================================
 // Constructors
 //======================================================================
 
+// Returns an immediate integer if the value is in the fixnum range, and boxes it otherwise.
 Obj *make_int(void *root, int value) {
+    if (FIXNUM_MIN <= value && value <= FIXNUM_MAX)
+        return make_fixnum(value);
     Obj *r = alloc(root, TINT, sizeof(int));
     r->value = value;
     return r;
 }
 
+// Returns the FNV-1a hash of the given name.
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
 Obj *make_symbol(void *root, const char *name)
 {
-    Obj *sym = alloc(root, TSYMBOL, strlen(name) + 1);
+    Obj *sym = alloc(root, TSYMBOL, offsetof(Obj, name) - offsetof(Obj, value) + strlen(name) + 1);
+    SET_GLOBAL(sym, Nil);
+    sym->hash = hash_name(name);
     strcpy(sym->name, name);
     return sym;
 }
 
 static Obj *cons(void *root, Obj **car, Obj **cdr) {
-    Obj *cell = alloc(root, TCELL, sizeof(Obj *) * 2);
-    cell->car = *car;
-    cell->cdr = *cdr;
+    Obj *cell = alloc(root, TCELL, sizeof(Ref) * 2);
+    SET_CAR(cell, *car);
+    SET_CDR(cell, *cdr);
     return cell;
 }
 
@@ -338,52 +1182,174 @@ static Obj *make_primitive(void *root, Primitive *fn) {
     return r;
 }
 
+static Obj *make_builtin(void *root, const Builtin *builtin) {
+    Obj *r = alloc(root, TPRIMITIVE, sizeof(Builtin *));
+    r->builtin = builtin;
+    r->flags |= FLAG_BUILTIN | FLAG_EXPR_ARGS;
+    return r;
+}
+
+// Flags the symbols of the parameter list as bound outside the global environment.
+static void mark_local_names(Obj *params) {
+    for (; obj_type(params) == TCELL; params = CDR(params))
+        CAR(params)->flags |= FLAG_LOCAL_NAME;
+    if (params != Nil)
+        params->flags |= FLAG_LOCAL_NAME;
+}
+
 static Obj *make_function(void *root, Obj **env, int type, Obj **params, Obj **body) {
     assert(type == TFUNCTION || type == TMACRO);
-    Obj *r = alloc(root, type, sizeof(Obj *) * 3);
-    r->params = *params;
-    r->body = *body;
-    r->env = *env;
+    mark_local_names(*params);
+    Obj *r = alloc(root, type, sizeof(Ref) * 3);
+    SET_PARAMS(r, *params);
+    SET_BODY(r, *body);
+    SET_ENV(r, *env);
+    return r;
+}
+
+// Returns a frame with the given number of slots for the variables in names, all set to ().
+static Obj *make_frame(void *root, Obj **up, Obj **names, int nslots) {
+    Obj *r = alloc(root, TENV, offsetof(Obj, slots) - offsetof(Obj, value) + nslots * sizeof(Ref));
+    SET_VARS(r, Nil);
+    SET_UP(r, *up);
+    SET_NAMES(r, *names);
+    r->nslots = nslots;
+    for (int i = 0; i < nslots; i++)
+        SET_SLOT(r, i, Nil);
     return r;
 }
 
 struct Obj *make_env(void *root, Obj **vars, Obj **up) {
-    Obj *r = alloc(root, TENV, sizeof(Obj *) * 2);
-    r->vars = *vars;
-    r->up = *up;
+    for (Obj *p = *vars; p != Nil; p = CDR(p))
+        CAR(CAR(p))->flags |= FLAG_LOCAL_NAME;
+    Obj *r = make_frame(root, up, &Nil, 0);
+    SET_VARS(r, *vars);
     return r;
 }
 
-// Returns ((x . y) . a)
-static Obj *acons(void *root, Obj **x, Obj **y, Obj **a) {
-    DEFINE1(cell);
-    *cell = cons(root, x, y);
-    return cons(root, cell, a);
+// Returns a vector of the given length, all the elements set to the given value.
+static Obj *make_vector(void *root, int nelems, Obj **init) {
+    Obj *r = alloc(root, TVECTOR, offsetof(Obj, elems) - offsetof(Obj, value) + nelems * sizeof(Ref));
+    r->nelems = nelems;
+    for (int i = 0; i < nelems; i++)
+        SET_ELEM(r, i, *init);
+    return r;
 }
 
-//======================================================================
-// Parser
-//
-// This is a hand-written recursive-descendent parser.
-//======================================================================
+// Returns an array of the given length, all the elements set to the given value.
+static Obj *make_array(void *root, int nelems, int32_t init) {
+    Obj *r = alloc(root, TARRAY, offsetof(Obj, ints) - offsetof(Obj, value) + nelems * sizeof(int32_t));
+    r->nelems = nelems;
+    for (int i = 0; i < nelems; i++)
+        r->ints[i] = init;
+    return r;
+}
 
-static const char symbol_chars[] = "~!@#$%^&*-_=+:/?<>";
+// Returns a string or a byte buffer of the given length, holding a copy of the bytes at data unless
+// it's NULL. The data must not be in the heap, as the allocation may move it.
+static Obj *make_text(void *root, int type, const char *data, int len) {
+    Obj *r = alloc(root, type, offsetof(Obj, bytes) - offsetof(Obj, value) + len);
+    SET_BASE(r, Nil);
+    r->start = 0;
+    r->len = len;
+    if (data)
+        memcpy(r->bytes, data, len);
+    return r;
+}
 
-static int peek(void) {
-    int c = buffer_getchar();
-    buffer_ungetc(c);
-    return c;
+Obj *make_string(void *root, const char *data, int len) {
+    return make_text(root, TSTRING, data, len);
 }
 
-// Destructively reverses the given list.
-static Obj *reverse(Obj *p) {
-    Obj *ret = Nil;
-    while (p != Nil) {
-        Obj *head = p;
-        p = p->cdr;
-        head->cdr = ret;
-        ret = head;
-    }
+Obj *make_bytes(void *root, const uint8_t *data, int len) {
+    return make_text(root, TBYTES, (const char *)data, len);
+}
+
+// Returns a string or a byte buffer sharing len bytes of the given one from start on.
+static Obj *make_slice(void *root, int type, Obj **text, int start, int len) {
+    Obj *r = alloc(root, type, offsetof(Obj, bytes) - offsetof(Obj, value));
+    Obj *base = BASE(*text);
+    SET_BASE(r, base == Nil ? *text : base);
+    r->start = (*text)->start + start;
+    r->len = len;
+    return r;
+}
+
+const char *string_bytes(Obj *obj) {
+    Obj *base = BASE(obj);
+    return (base == Nil ? obj : base)->bytes + obj->start;
+}
+
+// Returns an empty table with room for the given number of entries, which must be a power of 2. The
+// slots of the entries that have never been used hold Cparen, the deleted ones Dot.
+static Obj *make_table(void *root, int capacity) {
+    DEFINE1(entries);
+    *entries = make_vector(root, capacity * 2, &Cparen);
+    Obj *r = alloc(root, TTABLE, offsetof(Obj, epoch) - offsetof(Obj, value) + sizeof(uint32_t));
+    SET_ENTRIES(r, *entries);
+    r->nentries = 0;
+    r->nused = 0;
+    r->epoch = gc_epoch;
+    return r;
+}
+
+static Obj *make_local(void *root, Obj **var, Obj **binder, int depth, int slot) {
+    Obj *r = alloc(root, TLOCAL, offsetof(Obj, slot) - offsetof(Obj, value) + sizeof(uint16_t));
+    SET_VAR(r, *var);
+    SET_BINDER(r, *binder);
+    r->depth = depth;
+    r->slot = slot;
+    return r;
+}
+
+static Obj *make_node(void *root, Primitive *handler, Obj **form) {
+    Obj *r = alloc(root, TNODE, offsetof(Obj, handler) - offsetof(Obj, value) + sizeof(Primitive *));
+    SET_FORM(r, *form);
+    r->handler = handler;
+    return r;
+}
+
+// Returns bytecode with room for the given number of constants and bytes. The constants are ().
+static Obj *make_code(void *root, int nconsts, int nbytes) {
+    Obj *r = alloc(root, TCODE, offsetof(Obj, consts) - offsetof(Obj, value) + nconsts * sizeof(Ref) + nbytes);
+    r->nconsts = nconsts;
+    r->nbytes = nbytes;
+    for (int i = 0; i < nconsts; i++)
+        SET_CODE_CONST(r, i, Nil);
+    return r;
+}
+
+// Returns ((x . y) . a)
+static Obj *acons(void *root, Obj **x, Obj **y, Obj **a) {
+    DEFINE1(cell);
+    *cell = cons(root, x, y);
+    return cons(root, cell, a);
+}
+
+//======================================================================
+// Parser
+//
+// This is a hand-written recursive-descendent parser.
+//======================================================================
+
+static const char symbol_chars[] = "~!@#$%^&*-_=+:/?<>";
+
+static int peek(void) {
+    int c = buffer_getchar();
+    buffer_ungetc(c);
+    return c;
+}
+
+// Destructively reverses the given list.
+static Obj *reverse(Obj *p) {
+    Obj *ret = Nil;
+    while (p != Nil) {
+        Obj *head = p;
+        p = CDR(p);
+        SET_CDR(head, ret);
+        write_barrier(head, ret);
+        ret = head;
+    }
     return ret;
 }
 
@@ -416,7 +1382,8 @@ static Obj *read_list(void *root) {
             if (read_expr(root) != Cparen)
                 error("Closed parenthesis expected after dot");
             Obj *ret = reverse(*head);
-            (*head)->cdr = *last;
+            SET_CDR(*head, *last);
+            write_barrier(*head, *last);
             return ret;
         }
         *head = cons(root, obj, head);
@@ -426,12 +1393,25 @@ static Obj *read_list(void *root) {
 // May create a new symbol. If there's a symbol with the same name, it will not create a new symbol
 // but return the existing one.
 static Obj *intern(void *root, const char *name) {
-    for (Obj *p = Symbols; p != Nil; p = p->cdr)
-        if (strcmp(name, p->car->name) == 0)
-            return p->car;
+    uint32_t hash = hash_name(name);
+    size_t i = hash & (LISP_SYMBOL_TABLE_SIZE - 1);
+    for (; symbol_table[i]; i = (i + 1) & (LISP_SYMBOL_TABLE_SIZE - 1))
+        if (symbol_table[i]->hash == hash && strcmp(name, symbol_table[i]->name) == 0)
+            return symbol_table[i];
+    for (Obj *p = Symbols; p != Nil; p = CDR(p))
+        if (CAR(p)->hash == hash && strcmp(name, CAR(p)->name) == 0)
+            return CAR(p);
+
+    // The slot found above stays free, GC only updates the ones in use.
     DEFINE1(sym);
     *sym = make_symbol(root, name);
-    Symbols = cons(root, sym, &Symbols);
+    if (symbol_count < LISP_SYMBOL_TABLE_SIZE / 4 * 3) {
+        symbol_table[i] = *sym;
+        symbol_count++;
+        symbols_added = true;
+    } else {
+        Symbols = cons(root, sym, &Symbols);
+    }
     return *sym;
 }
 
@@ -445,6 +1425,76 @@ static Obj *read_quote(void *root) {
     return *tmp;
 }
 
+// Reader macro #(. It reads a list and returns a vector of its elements.
+static Obj *read_vector(void *root) {
+    DEFINE2(list, vec);
+    *list = read_list(root);
+    int len = length(*list);
+    if (len < 0)
+        error("Dotted list in a vector literal");
+    *vec = make_vector(root, len, &Nil);
+    for (int i = 0; i < len; i++, *list = CDR(*list))
+        SET_ELEM(*vec, i, CAR(*list));
+    return *vec;
+}
+
+static int hex_digit(int c) {
+    if (!isxdigit(c))
+        error("Malformed escape in a string");
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+// Reads the character following a backslash in a string literal, and returns the one it stands for.
+static int read_escape(void) {
+    int c = buffer_getchar();
+    switch (c) {
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    case 't':
+        return '\t';
+    case '0':
+        return '\0';
+    case '"':
+    case '\\':
+        return c;
+    case 'x': {
+        int hi = hex_digit(buffer_getchar());
+        return hi * 16 + hex_digit(buffer_getchar());
+    }
+    default:
+        error("Malformed escape in a string");
+    }
+}
+
+// Reads the contents of a string literal up to the closing quote, storing them to dst unless it's
+// NULL, and returns their length.
+static int read_text_bytes(char *dst) {
+    for (int len = 0;; len++) {
+        int c = buffer_getchar();
+        if (c == EOF)
+            error("Unclosed string");
+        if (c == '"')
+            return len;
+        if (c == '\\')
+            c = read_escape();
+        if (dst)
+            dst[len] = (char)c;
+    }
+}
+
+// Reader macros " and #". The literal is read twice, first to find its length, so that the
+// contents go straight from the input to the object and are not limited to SYMBOL_MAX_LEN.
+static Obj *read_text(void *root, int type) {
+    size_t start = current_index;
+    int len = read_text_bytes(NULL);
+    current_index = start;
+    Obj *text = make_text(root, type, NULL, len);
+    read_text_bytes(text->bytes);
+    return text;
+}
+
 static int read_number(int val) {
     while (isdigit(peek()))
         val = val * 10 + (buffer_getchar() - '0');
@@ -477,6 +1527,16 @@ Obj *read_expr(void *root) {
         }
         if (c == '(')
             return read_list(root);
+        if (c == '#' && peek() == '(') {
+            buffer_getchar();
+            return read_vector(root);
+        }
+        if (c == '"')
+            return read_text(root, TSTRING);
+        if (c == '#' && peek() == '"') {
+            buffer_getchar();
+            return read_text(root, TBYTES);
+        }
         if (c == ')')
             return Cparen;
         if (c == '.')
@@ -493,22 +1553,50 @@ Obj *read_expr(void *root) {
     }
 }
 
+// Prints a string or a byte buffer as the literal reading back as it. Runs of plain characters are
+// printed in chunks, which fit in the buffer of printf_to_handler().
+static int print_text(char *buf, int pos, Obj *obj) {
+    const char *s = string_bytes(obj);
+    pos = printf_to_handler(buf, pos, obj->type == TBYTES ? "#\"" : "\"");
+    int from = 0;
+    for (int i = 0; i <= obj->len; i++) {
+        int c = i < obj->len ? (uint8_t)s[i] : EOF;
+        bool plain = c != EOF && c != '"' && c != '\\' &&
+                     (isprint(c) || (c >= 0x80 && obj->type == TSTRING));
+        if (plain && i - from < 64)
+            continue;
+        pos = printf_to_handler(buf, pos, "%.*s", i - from, s + from);
+        from = plain ? i : i + 1;
+        if (plain || c == EOF)
+            continue;
+        if (c == '\n')
+            pos = printf_to_handler(buf, pos, "\\n");
+        else if (c == '\t')
+            pos = printf_to_handler(buf, pos, "\\t");
+        else if (c == '"' || c == '\\')
+            pos = printf_to_handler(buf, pos, "\\%c", c);
+        else
+            pos = printf_to_handler(buf, pos, "\\x%02x", c);
+    }
+    return printf_to_handler(buf, pos, "\"");
+}
+
 // Prints the given object.
 int print_to_buf(char *buf, int pos, Obj *obj) {
-    switch (obj->type) {
+    switch (obj_type(obj)) {
     case TCELL:
         pos = printf_to_handler(buf, pos, "(");
         for (;;) {
-            pos = print_to_buf(buf, pos, obj->car);
-            if (obj->cdr == Nil)
+            pos = print_to_buf(buf, pos, CAR(obj));
+            if (CDR(obj) == Nil)
                 break;
-            if (obj->cdr->type != TCELL) {
+            if (obj_type(CDR(obj)) != TCELL) {
                 pos = printf_to_handler(buf, pos, " . ");
-                pos = print_to_buf(buf, pos, obj->cdr);
+                pos = print_to_buf(buf, pos, CDR(obj));
                 break;
             }
             pos = printf_to_handler(buf, pos, " ");
-            obj = obj->cdr;
+            obj = CDR(obj);
         }
         pos = printf_to_handler(buf, pos, ")");
         return pos;
@@ -516,17 +1604,41 @@ int print_to_buf(char *buf, int pos, Obj *obj) {
 #define CASE(type, ...)                                     \
     case type:                                              \
         return printf_to_handler(buf, pos, __VA_ARGS__);
-    CASE(TINT, "%d", obj->value);
+    case TVECTOR:
+        pos = printf_to_handler(buf, pos, "#(");
+        for (int i = 0; i < obj->nelems; i++) {
+            if (i > 0)
+                pos = printf_to_handler(buf, pos, " ");
+            pos = print_to_buf(buf, pos, ELEM(obj, i));
+        }
+        return printf_to_handler(buf, pos, ")");
+
+    case TARRAY:
+        pos = printf_to_handler(buf, pos, "<array");
+        for (int i = 0; i < obj->nelems; i++)
+            pos = printf_to_handler(buf, pos, " %d", (int)obj->ints[i]);
+        return printf_to_handler(buf, pos, ">");
+
+    case TSTRING:
+    case TBYTES:
+        return print_text(buf, pos, obj);
+
+    CASE(TTABLE, "<table>");
+    CASE(TINT, "%d", int_value(obj));
     CASE(TSYMBOL, "%s", obj->name);
     CASE(TPRIMITIVE, "<primitive>");
     CASE(TFUNCTION, "<function>");
     CASE(TMACRO, "<macro>");
+    CASE(TLOCAL, "%s", VAR(obj)->name);
+    case TNODE:
+        return print_to_buf(buf, pos, FORM(obj));
+    CASE(TCODE, "<code>");
     CASE(TMOVED, "<moved>");
     CASE(TTRUE, "#t");
     CASE(TNIL, "()");
 #undef CASE
     default:
-        error("Bug: print: Unknown tag type: %d", obj->type);
+        error("Bug: print: Unknown tag type: %d", obj_type(obj));
     }
 }
 
@@ -537,7 +1649,7 @@ void print(Obj *obj) {
 // Returns the length of the given list. -1 if it's not a proper list.
 int length(Obj *list) {
     int len = 0;
-    for (; list->type == TCELL; list = list->cdr)
+    for (; obj_type(list) == TCELL; list = CDR(list))
         len++;
     return list == Nil ? len : -1;
 }
@@ -548,33 +1660,55 @@ int length(Obj *list) {
 
 static void add_variable(void *root, Obj **env, Obj **sym, Obj **val) {
     DEFINE2(vars, tmp);
-    *vars = (*env)->vars;
+    *vars = VARS(*env);
     *tmp = acons(root, sym, val, vars);
-    (*env)->vars = *tmp;
+    SET_VARS(*env, *tmp);
+    write_barrier(*env, *tmp);
+
+    if (Globals == Nil && UP(*env) == Nil)
+        Globals = *env;
+    if (*env == Globals) {
+        *tmp = CAR(*tmp);
+        SET_GLOBAL(*sym, *tmp);
+        write_barrier(*sym, *tmp);
+    } else {
+        (*sym)->flags |= FLAG_LOCAL_NAME;
+    }
+}
+
+// Returns the number of slots a frame needs for the given parameters. The rest parameter, if any,
+// takes the last one.
+static int count_params(Obj *params) {
+    int n = 0;
+    for (; obj_type(params) == TCELL; params = CDR(params))
+        n++;
+    return params == Nil ? n : n + 1;
 }
 
-// Returns a newly created environment frame.
+// Returns a newly created environment frame binding the parameters to the values in the list.
 static Obj *push_env(void *root, Obj **env, Obj **vars, Obj **vals) {
-    DEFINE3(map, sym, val);
-    *map = Nil;
-    for (; (*vars)->type == TCELL; *vars = (*vars)->cdr, *vals = (*vals)->cdr) {
-        if ((*vals)->type != TCELL)
+    DEFINE1(frame);
+    *frame = make_frame(root, env, vars, count_params(*vars));
+    int i = 0;
+    Obj *p = *vars, *v = *vals;
+    for (; obj_type(p) == TCELL; p = CDR(p), v = CDR(v)) {
+        if (obj_type(v) != TCELL)
             error("Cannot apply function: number of argument does not match");
-        *sym = (*vars)->car;
-        *val = (*vals)->car;
-        *map = acons(root, sym, val, map);
+        SET_SLOT(*frame, i++, CAR(v));
     }
-    if (*vars != Nil)
-        *map = acons(root, vars, vals, map);
-    return make_env(root, map, env);
+    if (p != Nil)
+        SET_SLOT(*frame, i, v);
+    return *frame;
 }
 
+static inline Obj *eval_compiled(void *root, Obj **env, Obj **expr);
+
 // Evaluates the list elements from head and returns the last return value.
 static Obj *progn(void *root, Obj **env, Obj **list) {
     DEFINE2(lp, r);
-    for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
-        *r = (*lp)->car;
-        *r = eval(root, env, r);
+    for (*lp = *list; *lp != Nil; *lp = CDR(*lp)) {
+        *r = CAR(*lp);
+        *r = eval_compiled(root, env, r);
     }
     return *r;
 }
@@ -583,101 +1717,384 @@ static Obj *progn(void *root, Obj **env, Obj **list) {
 Obj *eval_list(void *root, Obj **env, Obj **list) {
     DEFINE4(head, lp, expr, result);
     *head = Nil;
-    for (lp = list; *lp != Nil; *lp = (*lp)->cdr) {
-        *expr = (*lp)->car;
+    for (lp = list; *lp != Nil; *lp = CDR(*lp)) {
+        *expr = CAR(*lp);
         *result = eval(root, env, expr);
         *head = cons(root, result, head);
     }
     return reverse(*head);
 }
 
+// Returns the list of the values in the given slots.
+static Obj *list_of(void *root, int argc, Obj **argv) {
+    DEFINE1(list);
+    *list = Nil;
+    for (int i = argc - 1; i >= 0; i--)
+        *list = cons(root, &argv[i], list);
+    return *list;
+}
+
 static bool is_list(Obj *obj) {
-    return obj == Nil || obj->type == TCELL;
+    return obj == Nil || obj_type(obj) == TCELL;
+}
+
+static void analyse_body(void *root, Obj **fn);
+static Obj *eval_tail(void *root, Obj **env, Obj **expr, Obj **fn, Obj **frame);
+
+// Evaluates the body of the function in the given frame. A call to a function in a tail position
+// of the body is not made by eval_tail() but handed back, and the loop goes on with the body of the
+// callee in place of this one, so that the C stack does not grow with tail calls.
+static Obj *run_body(void *root, Obj **fn, Obj **frame) {
+    DEFINE4(callee, env, body, expr);
+    *callee = *fn;
+    *env = *frame;
+    for (;;) {
+        *body = BODY(*callee);
+        if (!((*body)->flags & FLAG_ANALYSED)) {
+            if ((*body)->flags & FLAG_CALLED)
+                analyse_body(root, callee);
+            else
+                (*body)->flags |= FLAG_CALLED;
+        }
+        for (; CDR(*body) != Nil; *body = CDR(*body)) {
+            *expr = CAR(*body);
+            eval_compiled(root, env, expr);
+        }
+        *expr = CAR(*body);
+        Obj *val = eval_tail(root, env, expr, callee, env);
+        if (val)
+            return val;
+    }
 }
 
 static Obj *apply_func(void *root, Obj **env, Obj **fn, Obj **args) {
-    DEFINE3(params, newenv, body);
-    *params = (*fn)->params;
-    *newenv = (*fn)->env;
+    DEFINE2(params, newenv);
+    *params = PARAMS(*fn);
+    *newenv = ENV(*fn);
     *newenv = push_env(root, newenv, params, args);
-    *body = (*fn)->body;
-    return progn(root, newenv, body);
-}
-
-// Apply fn with args.
-static Obj *apply(void *root, Obj **env, Obj **fn, Obj **args) {
-    if (!is_list(*args))
-        error("argument must be a list");
-    if ((*fn)->type == TPRIMITIVE)
-        return (*fn)->fn(root, env, args);
-    if ((*fn)->type == TFUNCTION) {
-        DEFINE1(eargs);
-        *eargs = eval_list(root, env, args);
-        return apply_func(root, env, fn, eargs);
-    }
-    error("not supported");
-}
-
-// Searches for a variable by symbol. Returns null if not found.
-static Obj *find(Obj **env, Obj *sym) {
-    for (Obj *p = *env; p != Nil; p = p->up) {
-        for (Obj *cell = p->vars; cell != Nil; cell = cell->cdr) {
-            Obj *bind = cell->car;
-            if (sym == bind->car)
+    return run_body(root, fn, newenv);
+}
+
+// Returns the frame of a call to the function. The arguments are evaluated right into its slots.
+static Obj *make_call_frame(void *root, Obj **env, Obj **fn, Obj **args) {
+    DEFINE4(params, frame, lp, val);
+    *params = PARAMS(*fn);
+    *frame = ENV(*fn);
+    *frame = make_frame(root, frame, params, count_params(*params));
+    int i = 0;
+    for (*lp = *args; obj_type(*params) == TCELL; *params = CDR(*params), *lp = CDR(*lp)) {
+        if (obj_type(*lp) != TCELL)
+            error("Cannot apply function: number of argument does not match");
+        *val = CAR(*lp);
+        *val = eval_compiled(root, env, val);
+        SET_SLOT(*frame, i++, *val);
+        write_barrier(*frame, *val);
+    }
+    if (*params != Nil) {
+        *val = eval_list(root, env, lp);
+        SET_SLOT(*frame, i, *val);
+        write_barrier(*frame, *val);
+    } else {
+        // Extra arguments are still evaluated for their side effects.
+        progn(root, env, lp);
+    }
+    return *frame;
+}
+
+// Searches for a variable by symbol. Returns null if not found. Otherwise returns the object
+// holding the value, which is either a frame, with the index of the parameter stored to *slot, or a
+// (symbol . value) binding, with -1 stored to *slot. If slot is null, the parameters are skipped.
+// The bindings of the global environment are not searched for, the symbol points to its own. The
+// names of a frame made by a let are its bindings, those of a loop are the rest of the form, see
+// let_tail() and loop_frame().
+// The frames, their parameter lists and their association lists hold no fixnums, so their
+// references are decoded without checking for one.
+#define FRAME_REF(ref) read_barrier(ref_to_ptr(ref))
+
+static Obj *find(Obj **env, Obj *sym, int *slot) {
+    for (Obj *p = *env; p != Nil; p = FRAME_REF(p->up)) {
+        if (p == Globals) {
+            Obj *bind = FRAME_REF(sym->global);
+            if (slot)
+                *slot = -1;
+            return bind == Nil ? NULL : bind;
+        }
+        if (slot) {
+            int i = 0;
+            Obj *name = FRAME_REF(p->names);
+            for (; i < p->nslots && name->type == TCELL; name = FRAME_REF(name->cdr), i++) {
+                Obj *var = FRAME_REF(name->car);
+                if (var == sym || (var->type == TCELL && FRAME_REF(var->car) == sym)) {
+                    *slot = i;
+                    return p;
+                }
+            }
+            if (name == sym) {
+                *slot = i;
+                return p;
+            }
+        }
+        for (Obj *cell = FRAME_REF(p->vars); cell != Nil; cell = FRAME_REF(cell->cdr)) {
+            Obj *bind = FRAME_REF(cell->car);
+            if (FRAME_REF(bind->car) == sym) {
+                if (slot)
+                    *slot = -1;
                 return bind;
+            }
         }
     }
     return NULL;
 }
 
+// Returns the value of a variable found by find().
+static inline Obj *var_value(Obj *owner, int slot) {
+    return slot < 0 ? CDR(owner) : SLOT(owner, slot);
+}
+
+// Sets the value of a variable found by find().
+static void set_var_value(Obj *owner, int slot, Obj *val) {
+    if (slot < 0)
+        SET_CDR(owner, val);
+    else
+        SET_SLOT(owner, slot, val);
+    write_barrier(owner, val);
+}
+
+// Returns the frame holding the parameter the reference points to, or null if the frame that many
+// levels up is not a call to the function it was resolved against. The latter only happens to code
+// that is evaluated in other environments than its own, e.g. as part of a macro expansion.
+static Obj *local_frame(Obj *env, Obj *local) {
+    for (int depth = local->depth; depth > 0 && env != Nil; depth--)
+        env = FRAME_REF(env->up);
+    return env != Nil && env->names == local->binder ? env : NULL;
+}
+
+// Returns the name of a variable, given as a symbol or a reference.
+static const char *var_name(Obj *var) {
+    return obj_type(var) == TLOCAL ? VAR(var)->name : var->name;
+}
+
+// Returns the value of a variable, given as a symbol or a reference, or null if it's not bound.
+// The symbols never bound outside the global environment, which most functions are, skip the search
+// through the frames.
+static Obj *lookup(Obj **env, Obj *var) {
+    int slot;
+    if (obj_type(var) == TLOCAL) {
+        Obj *frame = local_frame(*env, var);
+        if (frame)
+            return SLOT(frame, var->slot);
+        var = VAR(var);
+    }
+    if (!(var->flags & FLAG_LOCAL_NAME)) {
+        Obj *bind = GLOBAL(var);
+        return bind == Nil ? NULL : CDR(bind);
+    }
+    Obj *owner = find(env, var, &slot);
+    return owner ? var_value(owner, slot) : NULL;
+}
+
+// Evaluates an expression of the body of a function. The nodes and the parameters, which make most
+// of the compiled code, are evaluated without the checks eval() does.
+static inline Obj *eval_compiled(void *root, Obj **env, Obj **expr) {
+    Obj *obj = *expr;
+    if (is_fixnum(obj))
+        return obj;
+    if (obj->type == TNODE)
+        return obj->handler(root, env, expr);
+    if (obj->type == TLOCAL) {
+        Obj *frame = local_frame(*env, obj);
+        if (frame)
+            return SLOT(frame, obj->slot);
+    }
+    return eval(root, env, expr);
+}
+
 // Expands the given macro application form.
 static Obj *macroexpand(void *root, Obj **env, Obj **obj) {
-    if ((*obj)->type != TCELL || (*obj)->car->type != TSYMBOL)
+    if (obj_type(*obj) != TCELL || (obj_type(CAR(*obj)) != TSYMBOL && obj_type(CAR(*obj)) != TLOCAL))
         return *obj;
-    DEFINE3(bind, macro, args);
-    *bind = find(env, (*obj)->car);
-    if (!*bind || (*bind)->cdr->type != TMACRO)
+    DEFINE2(macro, args);
+    *macro = lookup(env, CAR(*obj));
+    if (!*macro || obj_type(*macro) != TMACRO)
         return *obj;
-    *macro = (*bind)->cdr;
-    *args = (*obj)->cdr;
+    *args = CDR(*obj);
     return apply_func(root, env, macro, args);
 }
 
+static void analyse_form(void *root, Obj **scope, Obj **made, Obj **form);
+static Obj *compile_form(void *root, Obj **form);
+
+// Replaces the macro call form with its expansion, so that the macro is run once per call site
+// rather than once per evaluation. The expansion is analysed in the given environment, as it's
+// evaluated in there from now on. A sealed form is expanded anew each time instead, see
+// rewrite_car().
+static void displace(void *root, Obj **env, Obj **form, Obj **expansion) {
+    SET_CAR(*form, CAR(*expansion));
+    write_barrier(*form, CAR(*expansion));
+    SET_CDR(*form, CDR(*expansion));
+    write_barrier(*form, CDR(*expansion));
+    DEFINE2(scope, made);
+    *scope = *env;
+    *made = Nil;
+    analyse_form(root, scope, made, form);
+}
+
+// Checks the number of arguments given to the builtin.
+static void check_args(const Builtin *builtin, int argc) {
+    if (argc < builtin->min_args || (builtin->max_args >= 0 && argc > builtin->max_args))
+        error("Malformed %s", builtin->name);
+}
+
+// Calls the builtin with the values of the arguments. They are evaluated into slots of the root
+// stack, so that no list is consed for them.
+static Obj *call_builtin(void *root, Obj **env, const Builtin *builtin, Obj **args) {
+    int argc = length(*args);
+    check_args(builtin, argc);
+    ADD_ROOT(argc + 1);
+    Obj **argv = (Obj **)root_ADD_ROOT_;
+    Obj **lp = argv + argc;
+    *lp = *args;
+    for (int i = 0; i < argc; i++, *lp = CDR(*lp)) {
+        argv[i] = CAR(*lp);
+        argv[i] = eval_compiled(root, env, &argv[i]);
+    }
+    return builtin->fn(root, env, argc, argv);
+}
+
+static Obj *prim_if(void *root, Obj **env, Obj **list);
+static Obj *node_if(void *root, Obj **env, Obj **node);
+static Obj *node_call(void *root, Obj **env, Obj **node);
+static inline bool head_is(Obj *form, Primitive *fn);
+
+// Evaluates a special form up to its expression in a tail position, which is stored to *expr, and
+// may switch *env to a frame of its own. Returns false if there is none, with the value of the
+// form stored to *expr instead.
+typedef bool TailForm(void *root, Obj **env, Obj **list, Obj **expr);
+
+static TailForm *tail_form_of(Primitive *fn);
+
+// Evaluates the expression in a tail position of the body of a function. A call to a function is
+// prepared but not made: the function is stored to *fn, the frame of the call to *frame, and null
+// is returned, for run_body() to run the body of the function. The branches of an if, the last
+// expression of a progn, a let or a cond clause, and the expansion of a macro are in a tail
+// position if the form is.
+static Obj *eval_tail(void *root, Obj **env, Obj **expr, Obj **fn, Obj **frame) {
+    DEFINE3(form, args, local);
+    *form = *expr;
+    // A let switches to its own frame, and the caller's environment is left as it is.
+    *local = *env;
+    env = local;
+    for (;;) {
+        if (is_fixnum(*form))
+            return *form;
+        if ((*form)->type == TNODE) {
+            Primitive *handler = (*form)->handler;
+            if (handler == node_call) {
+                *form = FORM(*form);
+            } else if (handler == node_if && head_is(FORM(*form), prim_if)) {
+                *form = FORM(*form);
+            } else {
+                return handler(root, env, form);
+            }
+        }
+        if ((*form)->type != TCELL)
+            return eval_compiled(root, env, form);
+
+        *fn = CAR(*form);
+        *args = CDR(*form);
+        if (obj_type(*fn) == TSYMBOL || obj_type(*fn) == TLOCAL) {
+            *fn = lookup(env, *fn);
+            if (!*fn)
+                error("Undefined symbol: %s", var_name(CAR(*form)));
+            if (obj_type(*fn) == TMACRO) {
+                bool uncached = (*fn)->flags & FLAG_UNCACHED;
+                *args = apply_func(root, env, fn, args);
+                if (obj_type(*args) != TCELL || uncached || is_sealed(*form))
+                    *form = *args;
+                else
+                    displace(root, env, form, args);
+                continue;
+            }
+        } else {
+            *fn = eval(root, env, fn);
+        }
+        if (obj_type(*fn) != TPRIMITIVE && obj_type(*fn) != TFUNCTION)
+            error("The head of a list must be a function");
+        if (!is_list(*args))
+            error("argument must be a list");
+        if (obj_type(*fn) == TPRIMITIVE) {
+            if ((*fn)->flags & FLAG_BUILTIN)
+                return call_builtin(root, env, (*fn)->builtin, args);
+            TailForm *tail_form = tail_form_of((*fn)->fn);
+            if (tail_form) {
+                if (!tail_form(root, env, args, form))
+                    return *form;
+                continue;
+            }
+            if ((*fn)->fn != prim_if || length(*args) < 2)
+                return (*fn)->fn(root, env, args);
+            // (if cond then else ...)
+            *form = CAR(*args);
+            if (eval_compiled(root, env, form) != Nil) {
+                *form = CAR(CDR(*args));
+                continue;
+            }
+            *args = CDR(CDR(*args));
+            if (*args == Nil)
+                return Nil;
+            for (; CDR(*args) != Nil; *args = CDR(*args)) {
+                *form = CAR(*args);
+                eval_compiled(root, env, form);
+            }
+            *form = CAR(*args);
+            continue;
+        }
+        *frame = make_call_frame(root, env, fn, args);
+        return NULL;
+    }
+}
+
+static Obj *run_code(void *root, Obj **env, Obj **code);
+
 // Evaluates the S expression.
 Obj *eval(void *root, Obj **env, Obj **obj) {
-    if (!is_valid_ptr(*obj))
+    if (!is_lisp_object(*obj))
         error("Unexpected statement. Evaluation terminated");
 
-    switch ((*obj)->type) {
+    switch (obj_type(*obj)) {
     case TINT:
     case TPRIMITIVE:
     case TFUNCTION:
+    case TVECTOR:
+    case TARRAY:
+    case TSTRING:
+    case TBYTES:
+    case TTABLE:
     case TTRUE:
     case TNIL:
         // Self-evaluating objects
         return *obj;
-    case TSYMBOL: {
+    case TNODE:
+        return (*obj)->handler(root, env, obj);
+    case TCODE:
+        return run_code(root, env, obj);
+    case TSYMBOL:
+    case TLOCAL: {
         // Variable
-        Obj *bind = find(env, *obj);
-        if (!bind)
-            error("Undefined symbol: %s", (*obj)->name);
-        return bind->cdr;
+        Obj *val = lookup(env, *obj);
+        if (!val)
+            error("Undefined symbol: %s", var_name(*obj));
+        return val;
     }
     case TCELL: {
-        // Function application form
-        DEFINE3(fn, expanded, args);
-        *expanded = macroexpand(root, env, obj);
-        if (*expanded != *obj)
-            return eval(root, env, expanded);
-        *fn = (*obj)->car;
-        *fn = eval(root, env, fn);
-        *args = (*obj)->cdr;
-        if ((*fn)->type != TPRIMITIVE && (*fn)->type != TFUNCTION)
-            error("The head of a list must be a function");
-        return apply(root, env, fn, args);
+        // Function application form. It's evaluated as in a tail position, then the function
+        // called, if any, is run.
+        DEFINE2(fn, frame);
+        Obj *val = eval_tail(root, env, obj, fn, frame);
+        return val ? val : run_body(root, fn, frame);
     }
     default:
-        error("Unexpected statement. Evaluation terminated. Bug: eval: Unknown tag type: %d", (*obj)->type);
+        error("Unexpected statement. Evaluation terminated. Bug: eval: Unknown tag type: %d", obj_type(*obj));
     }
 }
 
@@ -689,58 +2106,86 @@ Obj *eval(void *root, Obj **env, Obj **obj) {
 static Obj *prim_quote(void *root, Obj **env, Obj **list) {
     if (length(*list) != 1)
         error("Malformed quote");
-    return (*list)->car;
+    return CAR(*list);
 }
 
 // (cons expr expr)
-static Obj *prim_cons(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2)
-        error("Malformed cons");
-    Obj *cell = eval_list(root, env, list);
-    cell->cdr = cell->cdr->car;
-    return cell;
+static Obj *prim_cons(void *root, Obj **env, int argc, Obj **argv) {
+    return cons(root, &argv[0], &argv[1]);
 }
 
 // (car <cell>)
-static Obj *prim_car(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) < 1 || args->car->type != TCELL || args->cdr != Nil)
+static Obj *prim_car(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TCELL)
         error("Malformed car");
-    return args->car->car;
+    return CAR(argv[0]);
 }
 
 // (cdr <cell>)
-static Obj *prim_cdr(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) < 1 || args->car->type != TCELL || args->cdr != Nil)
+static Obj *prim_cdr(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TCELL)
         error("Malformed cdr");
-    return args->car->cdr;
+    return CDR(argv[0]);
 }
 
 // (setq <symbol> expr)
 static Obj *prim_setq(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
+    if (length(*list) != 2 || (obj_type(CAR(*list)) != TSYMBOL && obj_type(CAR(*list)) != TLOCAL))
         error("Malformed setq");
-    DEFINE2(bind, value);
-    *bind = find(env, (*list)->car);
-    if (!*bind)
-        error("Unbound variable %s", (*list)->car->name);
-    if ((*list)->car->constant)
-        error("Cannot change constant %s", (*list)->car->name);
-    *value = (*list)->cdr->car;
+    DEFINE3(var, owner, value);
+    *var = CAR(*list);
+    int slot = -1;
+    if (obj_type(*var) == TLOCAL) {
+        slot = (*var)->slot;
+        *owner = local_frame(*env, *var);
+        *var = VAR(*var);
+    }
+    if (!*owner)
+        *owner = find(env, *var, &slot);
+    if (!*owner)
+        error("Unbound variable %s", (*var)->name);
+    if ((*var)->constant)
+        error("Cannot change constant %s", (*var)->name);
+    *value = CAR(CDR(*list));
     *value = eval(root, env, value);
-    (*bind)->cdr = *value;
+    set_var_value(*owner, slot, *value);
     return *value;
 }
 
 // (setcar <cell> expr)
-static Obj *prim_setcar(void *root, Obj **env, Obj **list) {
-    DEFINE1(args);
-    *args = eval_list(root, env, list);
-    if (length(*args) != 2 || (*args)->car->type != TCELL)
+static Obj *prim_setcar(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TCELL)
         error("Malformed setcar");
-    (*args)->car->car = (*args)->cdr->car;
-    return (*args)->car;
+    SET_CAR(argv[0], argv[1]);
+    write_barrier(argv[0], argv[1]);
+    return argv[0];
+}
+
+// Sets the value of the given binding to an integer.
+static void set_int_binding(void *root, Obj **bind, int value) {
+    Obj *val = make_int(root, value);
+    SET_CDR(*bind, val);
+    write_barrier(*bind, val);
+}
+
+// Starts counting the iterations of a loop. Those of the loops nested in it count towards the same
+// MAX_LOOP_ITERATIONS as its own.
+static void enter_loop(void) {
+    if (loop_depth++ == 0)
+        loop_iterations = 0;
+}
+
+static void leave_loop(void) {
+    loop_depth--;
+}
+
+// Ends an iteration of a loop: checks the limit, then runs the GC step and the cycle yield.
+static void next_iteration(void) {
+    if (++loop_iterations > MAX_LOOP_ITERATIONS)
+        error("Maximum loop iterations (%d) exceeded. Possible infinite loop detected.", MAX_LOOP_ITERATIONS);
+    lisp_gc_step();
+    if (cycle_yield)
+        cycle_yield();
 }
 
 // (while cond expr ...)
@@ -750,29 +2195,229 @@ static Obj *prim_while(void *root, Obj **env, Obj **list) {
     if (length(*list) < 2)
         error("Malformed while");
     cycle_in_progress = true;
+    enter_loop();
     DEFINE3(cond, exprs, itr);
-    *cond = (*list)->car;
+    *cond = CAR(*list);
+    int count = 0;
     *itr = get_variable(root, env, "#itr");
-    (*itr)->cdr->value = 0;
+    set_int_binding(root, itr, count);
     while (eval(root, env, cond) != Nil) {
-        *exprs = (*list)->cdr;
+        *exprs = CDR(*list);
         eval_list(root, env, exprs);
-        (*itr)->cdr->value++;
+        set_int_binding(root, itr, ++count);
+        next_iteration();
+    }
+    cycle_in_progress = false;
+    leave_loop();
+    return Nil;
+}
 
-        if ((*itr)->cdr->value > MAX_LOOP_ITERATIONS) {
-            cycle_in_progress = false;
-            error("Maximum loop iterations (%d) exceeded. Possible infinite loop detected.", MAX_LOOP_ITERATIONS);
+// Evaluates all but the last expression of the list, which is stored to *expr, see TailForm.
+static bool seq_tail(void *root, Obj **env, Obj **list, Obj **expr) {
+    if (*list == Nil) {
+        *expr = Nil;
+        return false;
+    }
+    DEFINE1(lp);
+    for (*lp = *list; CDR(*lp) != Nil; *lp = CDR(*lp)) {
+        *expr = CAR(*lp);
+        eval_compiled(root, env, expr);
+    }
+    *expr = CAR(*lp);
+    return true;
+}
+
+// (progn expr ...)
+static bool progn_tail(void *root, Obj **env, Obj **list, Obj **expr) {
+    if (length(*list) < 0)
+        error("Malformed progn");
+    return seq_tail(root, env, list, expr);
+}
+
+// Returns the number of variables the bindings of a let introduce, or -1 if they are malformed.
+// A binding is (<symbol> expr), or (<symbol>) or <symbol> for a variable set to ().
+static int count_bindings(Obj *bindings) {
+    int n = 0;
+    for (; obj_type(bindings) == TCELL; bindings = CDR(bindings), n++) {
+        Obj *binding = CAR(bindings);
+        if (obj_type(binding) == TCELL) {
+            int len = length(CDR(binding));
+            if (obj_type(CAR(binding)) != TSYMBOL || len < 0 || len > 1)
+                return -1;
+        } else if (obj_type(binding) != TSYMBOL) {
+            return -1;
         }
+    }
+    return bindings == Nil ? n : -1;
+}
+
+// Returns the variable of a binding of a let.
+static inline Obj *binding_var(Obj *binding) {
+    return obj_type(binding) == TCELL ? CAR(binding) : binding;
+}
 
-        if (cycle_yield)
-            cycle_yield();
+// (let (<binding> ...) expr ...)
+//
+// The values are all computed in the environment of the let, then the body is evaluated in a frame
+// binding the variables, without a function being made and called. The bindings list names the
+// slots of the frame, so that the variables are resolved like parameters.
+static bool let_tail(void *root, Obj **env, Obj **list, Obj **expr) {
+    int n = obj_type(*list) == TCELL ? count_bindings(CAR(*list)) : -1;
+    if (n < 0 || length(CDR(*list)) < 0)
+        error("Malformed let");
+    DEFINE3(bindings, frame, val);
+    *bindings = CAR(*list);
+    *frame = make_frame(root, env, bindings, n);
+    for (int i = 0; *bindings != Nil; *bindings = CDR(*bindings), i++) {
+        Obj *binding = CAR(*bindings);
+        binding_var(binding)->flags |= FLAG_LOCAL_NAME;
+        if (obj_type(binding) != TCELL || CDR(binding) == Nil)
+            continue;
+        *val = CAR(CDR(binding));
+        *val = eval_compiled(root, env, val);
+        SET_SLOT(*frame, i, *val);
+        write_barrier(*frame, *val);
     }
-    cycle_in_progress = false;
-    return Nil;
+    *env = *frame;
+    *list = CDR(*list);
+    return seq_tail(root, env, list, expr);
+}
+
+// (cond (expr expr ...) ...)
+//
+// A clause with no expression but its test gives the value of the test.
+static bool cond_tail(void *root, Obj **env, Obj **list, Obj **expr) {
+    if (length(*list) < 0)
+        error("Malformed cond");
+    DEFINE1(clause);
+    for (; *list != Nil; *list = CDR(*list)) {
+        *clause = CAR(*list);
+        if (obj_type(*clause) != TCELL || length(*clause) < 0)
+            error("Malformed cond");
+        *expr = CAR(*clause);
+        *expr = eval_compiled(root, env, expr);
+        if (*expr != Nil) {
+            *clause = CDR(*clause);
+            return *clause == Nil ? false : seq_tail(root, env, clause, expr);
+        }
+    }
+    *expr = Nil;
+    return false;
+}
+
+// Evaluates the special form with the given function, then the expression in its tail position.
+static Obj *eval_tail_form(void *root, Obj **env, Obj **list, TailForm *fn) {
+    DEFINE3(local, args, expr);
+    *local = *env;
+    *args = *list;
+    if (!fn(root, local, args, expr))
+        return *expr;
+    return eval_compiled(root, local, expr);
+}
+
+// The special forms above, evaluated as a whole where they are not in a tail position
+static Obj *prim_progn(void *root, Obj **env, Obj **list) {
+    return eval_tail_form(root, env, list, progn_tail);
+}
+
+static Obj *prim_let(void *root, Obj **env, Obj **list) {
+    return eval_tail_form(root, env, list, let_tail);
+}
+
+static Obj *prim_cond(void *root, Obj **env, Obj **list) {
+    return eval_tail_form(root, env, list, cond_tail);
+}
+
+// Returns the function evaluating the special form up to its tail position, or null.
+static TailForm *tail_form_of(Primitive *fn) {
+    if (fn == prim_progn)
+        return progn_tail;
+    if (fn == prim_let)
+        return let_tail;
+    if (fn == prim_cond)
+        return cond_tail;
+    return NULL;
+}
+
+// Returns true if the rest of a dotimes or a dolist, ((<symbol> expr [expr]) expr ...), is
+// well-formed.
+static bool loop_ok(Obj *list) {
+    if (obj_type(list) != TCELL || length(CDR(list)) < 0)
+        return false;
+    int n = length(CAR(list));
+    return (n == 2 || n == 3) && obj_type(CAR(CAR(list))) == TSYMBOL;
+}
+
+// Returns the frame of a dotimes or a dolist, with a slot for its variable. The rest of the form
+// names the slot, so that the variable is resolved like a parameter.
+static Obj *loop_frame(void *root, Obj **env, Obj **list) {
+    CAR(CAR(*list))->flags |= FLAG_LOCAL_NAME;
+    return make_frame(root, env, list, 1);
+}
+
+// Evaluates the body of a loop with the variable set to the given value.
+static void loop_step(void *root, Obj **frame, Obj **body, Obj *val) {
+    SET_SLOT(*frame, 0, val);
+    write_barrier(*frame, val);
+    progn(root, frame, body);
+    next_iteration();
+}
+
+// Returns the value of the result expression of a loop, if any, or ().
+static Obj *loop_result(void *root, Obj **frame, Obj **list) {
+    DEFINE1(expr);
+    *expr = CDR(CDR(CAR(*list)));
+    if (*expr == Nil)
+        return Nil;
+    *expr = CAR(*expr);
+    return eval_compiled(root, frame, expr);
+}
+
+// (dotimes (<symbol> expr [expr]) expr ...)
+//
+// Unlike while, the loops may be nested. All their iterations count towards the limit of the
+// outermost loop.
+static Obj *prim_dotimes(void *root, Obj **env, Obj **list) {
+    if (!loop_ok(*list))
+        error("Malformed dotimes");
+    DEFINE3(count, frame, body);
+    *count = CAR(CDR(CAR(*list)));
+    *count = eval_compiled(root, env, count);
+    if (obj_type(*count) != TINT)
+        error("dotimes takes only numbers");
+    *frame = loop_frame(root, env, list);
+    *body = CDR(*list);
+    int n = int_value(*count);
+    enter_loop();
+    for (int i = 0; i < n; i++)
+        loop_step(root, frame, body, make_int(root, i));
+    leave_loop();
+    SET_SLOT(*frame, 0, *count);
+    write_barrier(*frame, *count);
+    return loop_result(root, frame, list);
+}
+
+// (dolist (<symbol> expr [expr]) expr ...)
+static Obj *prim_dolist(void *root, Obj **env, Obj **list) {
+    if (!loop_ok(*list))
+        error("Malformed dolist");
+    DEFINE3(lp, frame, body);
+    *lp = CAR(CDR(CAR(*list)));
+    *lp = eval_compiled(root, env, lp);
+    if (length(*lp) < 0)
+        error("dolist takes only lists");
+    *frame = loop_frame(root, env, list);
+    *body = CDR(*list);
+    enter_loop();
+    for (; *lp != Nil; *lp = CDR(*lp))
+        loop_step(root, frame, body, CAR(*lp));
+    leave_loop();
+    SET_SLOT(*frame, 0, Nil);
+    return loop_result(root, frame, list);
 }
 
 // (gensym)
-static Obj *prim_gensym(void *root, Obj **env, Obj **list) {
+static Obj *prim_gensym(void *root, Obj **env, int argc, Obj **argv) {
   static int count = 0;
   char buf[10];
   snprintf(buf, sizeof(buf), "G__%d", count++);
@@ -780,67 +2425,58 @@ static Obj *prim_gensym(void *root, Obj **env, Obj **list) {
 }
 
 // (+ <integer> ...)
-static Obj *prim_plus(void *root, Obj **env, Obj **list) {
+static Obj *prim_plus(void *root, Obj **env, int argc, Obj **argv) {
     int sum = 0;
-    for (Obj *args = eval_list(root, env, list); args != Nil; args = args->cdr) {
-        if (args->car->type != TINT)
+    for (int i = 0; i < argc; i++) {
+        if (obj_type(argv[i]) != TINT)
             error("+ takes only numbers");
-        sum += args->car->value;
+        sum += int_value(argv[i]);
     }
     return make_int(root, sum);
 }
 
 // (- <integer> ...)
-static Obj *prim_minus(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    for (Obj *p = args; p != Nil; p = p->cdr)
-        if (p->car->type != TINT)
+static Obj *prim_minus(void *root, Obj **env, int argc, Obj **argv) {
+    for (int i = 0; i < argc; i++)
+        if (obj_type(argv[i]) != TINT)
             error("- takes only numbers");
-    if (args->cdr == Nil)
-        return make_int(root, -args->car->value);
-    int r = args->car->value;
-    for (Obj *p = args->cdr; p != Nil; p = p->cdr)
-        r -= p->car->value;
+    if (argc == 1)
+        return make_int(root, -int_value(argv[0]));
+    int r = int_value(argv[0]);
+    for (int i = 1; i < argc; i++)
+        r -= int_value(argv[i]);
     return make_int(root, r);
 }
 
 // (% <integer> <integer>)
-static Obj *prim_modulo(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) != 2)
-        error("Malformed MODULO");
-    Obj *x = args->car;
-    Obj *y = args->cdr->car;
-    if (x->type != TINT || y->type != TINT)
+static Obj *prim_modulo(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *x = argv[0];
+    Obj *y = argv[1];
+    if (obj_type(x) != TINT || obj_type(y) != TINT)
         error("MODULO takes only numbers");
 
-    if (y->value == 0)
+    if (int_value(y) == 0)
         error("Division by zero");
 
-    return make_int(root, x->value % y->value);
+    return make_int(root, int_value(x) % int_value(y));
 }
 
 // (/ <integer> <integer> ...)
-static Obj *prim_div(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-
-    if (length(args) < 2)
-        error("Malformed /");
-
-    for (Obj *p = args; p != Nil; p = p->cdr)
-        if (p->car->type != TINT)
+static Obj *prim_div(void *root, Obj **env, int argc, Obj **argv) {
+    for (int i = 0; i < argc; i++)
+        if (obj_type(argv[i]) != TINT)
             error("/ takes only numbers");
 
-    for (Obj *p = args->cdr; p != Nil; p = p->cdr)
-        if (p->car->value == 0)
+    for (int i = 1; i < argc; i++)
+        if (int_value(argv[i]) == 0)
             error("Division by zero");
 
-    if (args->car->value == 0)
+    if (int_value(argv[0]) == 0)
         return make_int(root, 0);
 
-    float r = args->car->value;
-    for (Obj *p = args->cdr; p != Nil; p = p->cdr)
-        r /= (float)p->car->value;
+    float r = int_value(argv[0]);
+    for (int i = 1; i < argc; i++)
+        r /= (float)int_value(argv[i]);
 
     return make_int(root, r);
 }
@@ -855,23 +2491,18 @@ static bool mul_with_overflow_check(int a, int b, int* res) {
 }
 
 // (* <integer> <integer> ...)
-static Obj *prim_mul(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-
-    if (length(args) < 2)
-        error("Malformed *");
-
-    for (Obj *p = args; p != Nil; p = p->cdr)
-        if (p->car->type != TINT)
+static Obj *prim_mul(void *root, Obj **env, int argc, Obj **argv) {
+    for (int i = 0; i < argc; i++)
+        if (obj_type(argv[i]) != TINT)
             error("* takes only numbers");
 
-    if (args->car->value == 0)
+    if (int_value(argv[0]) == 0)
         return make_int(root, 0);
 
-    int r = args->car->value;
-    for (Obj *p = args->cdr; p != Nil; p = p->cdr)
+    int r = int_value(argv[0]);
+    for (int i = 1; i < argc; i++)
     {
-        const bool is_overflow = ! mul_with_overflow_check(r, p->car->value, &r);
+        const bool is_overflow = ! mul_with_overflow_check(r, int_value(argv[i]), &r);
         if (is_overflow)
             error("Multiplication overflow");
     }
@@ -880,73 +2511,57 @@ static Obj *prim_mul(void *root, Obj **env, Obj **list) {
 }
 
 // (< <integer> <integer>)
-static Obj *prim_lt(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) != 2)
-        error("Malformed <");
-
-    Obj *x = args->car;
-    Obj *y = args->cdr->car;
-    if (x->type != TINT || y->type != TINT)
+static Obj *prim_lt(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *x = argv[0];
+    Obj *y = argv[1];
+    if (obj_type(x) != TINT || obj_type(y) != TINT)
         error("< takes only numbers");
 
-    return x->value < y->value ? True : Nil;
+    return int_value(x) < int_value(y) ? True : Nil;
 }
 
 // (<= <integer> <integer>)
-static Obj *prim_lte(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) != 2)
-        error("Malformed <=");
-
-    Obj *x = args->car;
-    Obj *y = args->cdr->car;
-    if (x->type != TINT || y->type != TINT)
+static Obj *prim_lte(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *x = argv[0];
+    Obj *y = argv[1];
+    if (obj_type(x) != TINT || obj_type(y) != TINT)
         error("<= takes only numbers");
 
-    return x->value <= y->value ? True : Nil;
+    return int_value(x) <= int_value(y) ? True : Nil;
 }
 
 // (> <integer> <integer>)
-static Obj *prim_gt(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) != 2)
-        error("Malformed >");
-
-    Obj *x = args->car;
-    Obj *y = args->cdr->car;
-    if (x->type != TINT || y->type != TINT)
+static Obj *prim_gt(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *x = argv[0];
+    Obj *y = argv[1];
+    if (obj_type(x) != TINT || obj_type(y) != TINT)
         error("> takes only numbers");
 
-    return x->value > y->value ? True : Nil;
+    return int_value(x) > int_value(y) ? True : Nil;
 }
 
 // (>= <integer> <integer>)
-static Obj *prim_gte(void *root, Obj **env, Obj **list) {
-    Obj *args = eval_list(root, env, list);
-    if (length(args) != 2)
-        error("Malformed >=");
-
-    Obj *x = args->car;
-    Obj *y = args->cdr->car;
-    if (x->type != TINT || y->type != TINT)
+static Obj *prim_gte(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *x = argv[0];
+    Obj *y = argv[1];
+    if (obj_type(x) != TINT || obj_type(y) != TINT)
         error(">= takes only numbers");
 
-    return x->value >= y->value ? True : Nil;
+    return int_value(x) >= int_value(y) ? True : Nil;
 }
 
 static Obj *handle_function(void *root, Obj **env, Obj **list, int type) {
-    if ((*list)->type != TCELL || !is_list((*list)->car) || (*list)->cdr->type != TCELL)
+    if (obj_type(*list) != TCELL || !is_list(CAR(*list)) || obj_type(CDR(*list)) != TCELL)
         error("Malformed lambda");
-    Obj *p = (*list)->car;
-    for (; p->type == TCELL; p = p->cdr)
-        if (p->car->type != TSYMBOL)
+    Obj *p = CAR(*list);
+    for (; obj_type(p) == TCELL; p = CDR(p))
+        if (obj_type(CAR(p)) != TSYMBOL)
             error("Parameter must be a symbol");
-    if (p != Nil && p->type != TSYMBOL)
+    if (p != Nil && obj_type(p) != TSYMBOL)
         error("Parameter must be a symbol");
     DEFINE2(params, body);
-    *params = (*list)->car;
-    *body = (*list)->cdr;
+    *params = CAR(*list);
+    *body = CDR(*list);
     return make_function(root, env, type, params, body);
 }
 
@@ -956,12 +2571,13 @@ static Obj *prim_lambda(void *root, Obj **env, Obj **list) {
 }
 
 static Obj *handle_defun(void *root, Obj **env, Obj **list, int type) {
-    if ((*list)->car->type != TSYMBOL || (*list)->cdr->type != TCELL)
+    if (obj_type(CAR(*list)) != TSYMBOL || obj_type(CDR(*list)) != TCELL)
         error("Malformed defun");
     DEFINE4(fn, sym, rest, bind);
-    *sym = (*list)->car;
-    *rest = (*list)->cdr;
-    *bind = find(env, *sym);
+    *sym = CAR(*list);
+    *rest = CDR(*list);
+    int slot;
+    *bind = find(env, *sym, &slot);
     if (*bind)
         error("Already defined: %s", (*sym)->name);
     *fn = handle_function(root, env, rest, type);
@@ -976,12 +2592,13 @@ static Obj *prim_defun(void *root, Obj **env, Obj **list) {
 
 // (define <symbol> expr)
 static Obj *prim_define(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
+    if (length(*list) != 2 || obj_type(CAR(*list)) != TSYMBOL)
         error("Malformed define");
     DEFINE3(sym, value, bind);
-    *sym = (*list)->car;
-    *value = (*list)->cdr->car;
-    *bind = find(env, *sym);
+    *sym = CAR(*list);
+    *value = CAR(CDR(*list));
+    int slot;
+    *bind = find(env, *sym, &slot);
     if (*bind)
         error("Already defined: %s", (*sym)->name);
     *value = eval(root, env, value);
@@ -994,103 +2611,772 @@ static Obj *prim_defmacro(void *root, Obj **env, Obj **list) {
     return handle_defun(root, env, list, TMACRO);
 }
 
+// (defmacro-uncached <symbol> (<symbol> ...) expr ...)
+static Obj *prim_defmacro_uncached(void *root, Obj **env, Obj **list) {
+    Obj *macro = handle_defun(root, env, list, TMACRO);
+    macro->flags |= FLAG_UNCACHED;
+    return macro;
+}
+
 // (macroexpand expr)
 static Obj *prim_macroexpand(void *root, Obj **env, Obj **list) {
     if (length(*list) != 1)
         error("Malformed macroexpand");
     DEFINE1(body);
-    *body = (*list)->car;
+    *body = CAR(*list);
     return macroexpand(root, env, body);
 }
 
 // (print expr)
-static Obj *prim_print(void *root, Obj **env, Obj **list) {
-    DEFINE1(tmp);
-    if (length(*list) != 1)
-        *tmp = eval_list(root, env, list);
-    else
-        *tmp = eval(root, env, &(*list)->car);
+static Obj *prim_print(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *tmp = argc == 1 ? argv[0] : list_of(root, argc, argv);
 
     char buf[SYMBOL_MAX_LEN];
-    print_to_buf(buf, 0, *tmp);
-    printf_to_handler(NULL, 0, buf);
-    print_to_log(buf);
+    print_to_buf(buf, 0, tmp);
+    printf_to_handler(NULL, 0, "%s", buf);
+    print_to_log("%s", buf);
     return Nil;
 }
 
+// (gc)
+static Obj *prim_gc(void *root, Obj **env, int argc, Obj **argv) {
+    if (!gc_running)
+        gc(root);
+    return make_int(root, stats.live_after_gc);
+}
+
+// Returns ((name . value) . alist). The value is clamped to the int range.
+static Obj *acons_stat(void *root, const char *name, size_t value, Obj **alist) {
+    DEFINE2(key, val);
+    *key = intern(root, name);
+    *val = make_int(root, value > INT_MAX ? INT_MAX : (int)value);
+    return acons(root, key, val, alist);
+}
+
+// (gc-stats)
+static Obj *prim_gc_stats(void *root, Obj **env, int argc, Obj **argv) {
+    GcStats s = stats;
+    size_t allocated = 0;
+    for (int i = 0; i < TMOVED; i++)
+        allocated += s.bytes_allocated[i];
+
+    DEFINE1(alist);
+    *alist = Nil;
+    *alist = acons_stat(root, "live", s.live_after_gc, alist);
+    *alist = acons_stat(root, "high-water", s.high_water, alist);
+    *alist = acons_stat(root, "allocated", allocated, alist);
+    *alist = acons_stat(root, "copied", s.bytes_copied, alist);
+    *alist = acons_stat(root, "pause-max", s.max_pause, alist);
+    *alist = acons_stat(root, "pause-total", s.total_pause, alist);
+    *alist = acons_stat(root, "major", s.major_collections, alist);
+    *alist = acons_stat(root, "minor", s.minor_collections, alist);
+    return *alist;
+}
+
 // (eval 'expr)
-static Obj *prim_eval(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("Malformed eval");
-    DEFINE2(quote, expr);
-    *quote = (*list)->car;
-    *expr = eval(root, env, quote);
-    return eval(root, env, expr);
+static Obj *prim_eval(void *root, Obj **env, int argc, Obj **argv) {
+    return eval(root, env, &argv[0]);
 }
 
 // (list expr ... expr)
-static Obj *prim_list(void *root, Obj **env, Obj **list) {
-    return eval_list(root, env, list);
+static Obj *prim_list(void *root, Obj **env, int argc, Obj **argv) {
+    return list_of(root, argc, argv);
 }
 
-// (if expr expr expr ...)
-static Obj *prim_if(void *root, Obj **env, Obj **list) {
-    if (length(*list) < 2)
-        error("Malformed if");
-    DEFINE3(cond, then, els);
-    *cond = (*list)->car;
-    *cond = eval(root, env, cond);
-    if (*cond != Nil) {
-        *then = (*list)->cdr->car;
-        return eval(root, env, then);
-    }
-    *els = (*list)->cdr->cdr;
-    return *els == Nil ? Nil : progn(root, env, els);
+// (make-vector <integer> expr)
+static Obj *prim_make_vector(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TINT || int_value(argv[0]) < 0)
+        error("Malformed make-vector");
+    if ((size_t)int_value(argv[0]) > INT_MAX / sizeof(Ref))
+        error("Vector too large");
+    return make_vector(root, int_value(argv[0]), argc == 2 ? &argv[1] : &Nil);
 }
 
-// (not expr)
-static Obj *prim_not(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("Malformed not");
+// (vector expr ...)
+static Obj *prim_vector(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *vec = make_vector(root, argc, &Nil);
+    for (int i = 0; i < argc; i++)
+        SET_ELEM(vec, i, argv[i]);
+    return vec;
+}
 
-    Obj *arg = eval_list(root, env, list)->car;
-    if (arg->type == TTRUE)
-        return Nil;
-    if (arg->type == TNIL)
-        return True;
-    if (arg->type != TINT)
-        error("not takes only boolean and int values");
+// Returns the index given to the vector or array primitive, checking that obj is of the given type
+// and that the index is in its range.
+static int index_arg(const char *name, int type, Obj *obj, Obj *index) {
+    if (obj_type(obj) != type || obj_type(index) != TINT)
+        error("Malformed %s", name);
+    int i = int_value(index);
+    if (i < 0 || i >= obj->nelems)
+        error("Index out of range: %d", i);
+    return i;
+}
 
-    const bool val = (bool)arg->value;
-    return val ? Nil : True;
+// (vector-ref <vector> <integer>)
+static Obj *prim_vector_ref(void *root, Obj **env, int argc, Obj **argv) {
+    return ELEM(argv[0], index_arg("vector-ref", TVECTOR, argv[0], argv[1]));
 }
 
-// (abs <integer>)
-static Obj *prim_abs(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 1)
-        error("Malformed abs");
+// (vector-set! <vector> <integer> expr)
+static Obj *prim_vector_set(void *root, Obj **env, int argc, Obj **argv) {
+    int i = index_arg("vector-set!", TVECTOR, argv[0], argv[1]);
+    SET_ELEM(argv[0], i, argv[2]);
+    write_barrier(argv[0], argv[2]);
+    return argv[2];
+}
 
-    Obj *arg = eval_list(root, env, list)->car;
-    if (arg->type != TINT)
-        error("abs takes only numbers");
+// (vector-length <vector>)
+static Obj *prim_vector_length(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TVECTOR)
+        error("Malformed vector-length");
+    return make_int(root, argv[0]->nelems);
+}
 
-    const int ret = arg->value < 0 ? -arg->value : arg->value;
-    return make_int(root, ret);
+// The kernels of the array primitives. They run over a whole array in one call. Where SSE2 is
+// available, as on every x86-64, they take four integers at a time, and the plain loops only do
+// what is left. Elsewhere the plain loops do all of it: they are kept free of calls, early exits
+// and branches on the overflow, so that a compiler vectorizing at -O3 can do the same.
+
+#if __SSE2__
+// Returns the lanes of a where mask is set, and those of b elsewhere.
+static inline __m128i select_epi32(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
 }
 
-// (and expr expr ..)
-static Obj *prim_and(void *root, Obj **env, Obj **list) {
-    if (length(*list) < 2)
-        error("Malformed and");
+// Returns the low 32 bits of the products of the lanes of a and b, see ints_scale(). Those are the
+// same whether the lanes are signed or not.
+static inline __m128i mullo_epi32(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
 
-    for (Obj *args = eval_list(root, env, list); args != Nil; args = args->cdr) {
-        if (args->car->type == TNIL)
-            return Nil;
-        if (args->car->type == TTRUE)
+// Adds the lanes of v, sign-extended to 64 bits, to the two lanes of acc.
+static inline __m128i add_epi32_to_epi64(__m128i acc, __m128i v, __m128i sign) {
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, sign));
+    return _mm_add_epi64(acc, _mm_unpackhi_epi32(v, sign));
+}
+
+static inline int64_t sum_epi64(__m128i v) {
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return lanes[0] + lanes[1];
+}
+
+static inline void store_epi32(int32_t lanes[4], __m128i v) {
+    _mm_storeu_si128((__m128i *)lanes, v);
+}
+
+#define LOAD_EPI32(p) _mm_loadu_si128((const __m128i *)(p))
+#endif
+
+static int64_t ints_sum(const int32_t *a, int n) {
+    int64_t sum = 0;
+    int i = 0;
+#if __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = LOAD_EPI32(a + i);
+        acc = add_epi32_to_epi64(acc, v, _mm_srai_epi32(v, 31));
+    }
+    sum = sum_epi64(acc);
+#endif
+    for (; i < n; i++)
+        sum += a[i];
+    return sum;
+}
+
+// The array must not be empty.
+static int32_t ints_min(const int32_t *a, int n) {
+    int32_t min = a[0];
+    int i = 0;
+#if __SSE2__
+    if (n >= 4) {
+        __m128i m = LOAD_EPI32(a);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m128i v = LOAD_EPI32(a + i);
+            m = select_epi32(_mm_cmplt_epi32(v, m), v, m);
+        }
+        int32_t lanes[4];
+        store_epi32(lanes, m);
+        for (int j = 0; j < 4; j++)
+            min = lanes[j] < min ? lanes[j] : min;
+    }
+#endif
+    for (; i < n; i++)
+        min = a[i] < min ? a[i] : min;
+    return min;
+}
+
+// The array must not be empty.
+static int32_t ints_max(const int32_t *a, int n) {
+    int32_t max = a[0];
+    int i = 0;
+#if __SSE2__
+    if (n >= 4) {
+        __m128i m = LOAD_EPI32(a);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m128i v = LOAD_EPI32(a + i);
+            m = select_epi32(_mm_cmpgt_epi32(v, m), v, m);
+        }
+        int32_t lanes[4];
+        store_epi32(lanes, m);
+        for (int j = 0; j < 4; j++)
+            max = lanes[j] > max ? lanes[j] : max;
+    }
+#endif
+    for (; i < n; i++)
+        max = a[i] > max ? a[i] : max;
+    return max;
+}
+
+// Sets dst[i] to a[i] * k. Returns false, with dst left as it is, if any of the products does not
+// fit in 32 bits. The products of the smallest and the largest element are the extremes, so they
+// are checked first and the loop only multiplies.
+static bool ints_scale(int32_t *restrict dst, const int32_t *restrict a, int n, int32_t k) {
+    if (n == 0)
+        return true;
+    int64_t lo = (int64_t)ints_min(a, n) * k, hi = (int64_t)ints_max(a, n) * k;
+    if (lo < INT32_MIN || lo > INT32_MAX || hi < INT32_MIN || hi > INT32_MAX)
+        return false;
+    int i = 0;
+#if __SSE2__
+    __m128i vk = _mm_set1_epi32(k);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128((__m128i *)(dst + i), mullo_epi32(LOAD_EPI32(a + i), vk));
+#endif
+    for (; i < n; i++)
+        dst[i] = a[i] * k;
+    return true;
+}
+
+// Sets dst[i] to a[i] + b[i]. Returns false if any of the sums does not fit in 32 bits, which is
+// when it wraps around to the other sign than both of the terms.
+static bool ints_add(int32_t *restrict dst, const int32_t *a, const int32_t *b, int n) {
+    int32_t overflow = 0;
+    int i = 0;
+#if __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = LOAD_EPI32(a + i), vb = LOAD_EPI32(b + i);
+        __m128i r = _mm_add_epi32(va, vb);
+        acc = _mm_or_si128(acc, _mm_and_si128(_mm_xor_si128(va, r), _mm_xor_si128(vb, r)));
+        _mm_storeu_si128((__m128i *)(dst + i), r);
+    }
+    overflow = _mm_movemask_ps(_mm_castsi128_ps(acc)) ? -1 : 0;
+#endif
+    for (; i < n; i++) {
+        int32_t r = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+        overflow |= (a[i] ^ r) & (b[i] ^ r);
+        dst[i] = r;
+    }
+    return overflow >= 0;
+}
+
+// Stores the dot product of a and b to *res. Returns false if it does not fit in 32 bits. The
+// products are split into their signed high and unsigned low 32 bits, which are summed apart, so
+// that neither sum can overflow.
+static bool ints_dot(const int32_t *a, const int32_t *b, int n, int32_t *res) {
+    int64_t high = 0, low = 0;
+    int i = 0;
+#if __SSE2__
+    // SSE2 only multiplies unsigned lanes. The signed high half is the unsigned one less b if a is
+    // negative and a if b is, the low half is the same.
+    __m128i high_acc = _mm_setzero_si128(), low_acc = _mm_setzero_si128();
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = LOAD_EPI32(a + i), vb = LOAD_EPI32(b + i);
+        __m128i even = _mm_mul_epu32(va, vb);
+        __m128i odd = _mm_mul_epu32(_mm_srli_epi64(va, 32), _mm_srli_epi64(vb, 32));
+        __m128i lows = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+        __m128i highs = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 3, 1)),
+                                           _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 3, 1)));
+        highs = _mm_sub_epi32(highs, _mm_and_si128(_mm_srai_epi32(va, 31), vb));
+        highs = _mm_sub_epi32(highs, _mm_and_si128(_mm_srai_epi32(vb, 31), va));
+        high_acc = add_epi32_to_epi64(high_acc, highs, _mm_srai_epi32(highs, 31));
+        low_acc = add_epi32_to_epi64(low_acc, lows, zero);
+    }
+    high = sum_epi64(high_acc);
+    low = sum_epi64(low_acc);
+#endif
+    for (; i < n; i++) {
+        int64_t p = (int64_t)a[i] * b[i];
+        high += p >> 32;
+        low += (uint32_t)p;
+    }
+    high += low >> 32;
+    low &= UINT32_MAX;
+    if (high == 0 ? low > INT32_MAX : high != -1 || low <= INT32_MAX)
+        return false;
+    *res = (int32_t)(uint32_t)low;
+    return true;
+}
+
+// Returns the integer argument of the primitive.
+static int int_arg(const char *name, Obj *obj) {
+    if (obj_type(obj) != TINT)
+        error("%s takes only numbers", name);
+    return int_value(obj);
+}
+
+// Checks that the argument of the primitive is an array.
+static void array_arg(const char *name, Obj *obj) {
+    if (obj_type(obj) != TARRAY)
+        error("Malformed %s", name);
+}
+
+// Returns the number of elements of the array in argv[0] from the optional start in argv[1] to the
+// optional end in argv[2], which may be empty, and stores the start to *start.
+static int array_range(const char *name, int argc, Obj **argv, int *start) {
+    array_arg(name, argv[0]);
+    *start = argc > 1 ? int_arg(name, argv[1]) : 0;
+    int end = argc > 2 ? int_arg(name, argv[2]) : argv[0]->nelems;
+    if (*start < 0 || end > argv[0]->nelems || *start > end)
+        error("Malformed %s", name);
+    return end - *start;
+}
+
+// (make-array <integer> <integer>)
+static Obj *prim_make_array(void *root, Obj **env, int argc, Obj **argv) {
+    int n = int_arg("make-array", argv[0]);
+    if (n < 0)
+        error("Malformed make-array");
+    if ((size_t)n > INT_MAX / sizeof(int32_t))
+        error("Array too large");
+    return make_array(root, n, argc == 2 ? int_arg("make-array", argv[1]) : 0);
+}
+
+// (array <integer> ...)
+static Obj *prim_array(void *root, Obj **env, int argc, Obj **argv) {
+    for (int i = 0; i < argc; i++)
+        int_arg("array", argv[i]);
+    Obj *arr = make_array(root, argc, 0);
+    for (int i = 0; i < argc; i++)
+        arr->ints[i] = int_value(argv[i]);
+    return arr;
+}
+
+// (array-ref <array> <integer>)
+static Obj *prim_array_ref(void *root, Obj **env, int argc, Obj **argv) {
+    return make_int(root, argv[0]->ints[index_arg("array-ref", TARRAY, argv[0], argv[1])]);
+}
+
+// (array-set! <array> <integer> <integer>)
+static Obj *prim_array_set(void *root, Obj **env, int argc, Obj **argv) {
+    int i = index_arg("array-set!", TARRAY, argv[0], argv[1]);
+    argv[0]->ints[i] = int_arg("array-set!", argv[2]);
+    return argv[2];
+}
+
+// (array-length <array>)
+static Obj *prim_array_length(void *root, Obj **env, int argc, Obj **argv) {
+    array_arg("array-length", argv[0]);
+    return make_int(root, argv[0]->nelems);
+}
+
+// (array-sum <array> <integer> <integer>)
+static Obj *prim_array_sum(void *root, Obj **env, int argc, Obj **argv) {
+    int start;
+    int n = array_range("array-sum", argc, argv, &start);
+    int64_t sum = ints_sum(argv[0]->ints + start, n);
+    if (sum < INT_MIN || sum > INT_MAX)
+        error("Integer overflow");
+    return make_int(root, (int)sum);
+}
+
+// (array-min <array> <integer> <integer>)
+static Obj *prim_array_min(void *root, Obj **env, int argc, Obj **argv) {
+    int start;
+    int n = array_range("array-min", argc, argv, &start);
+    if (n == 0)
+        error("array-min of an empty range");
+    return make_int(root, ints_min(argv[0]->ints + start, n));
+}
+
+// (array-max <array> <integer> <integer>)
+static Obj *prim_array_max(void *root, Obj **env, int argc, Obj **argv) {
+    int start;
+    int n = array_range("array-max", argc, argv, &start);
+    if (n == 0)
+        error("array-max of an empty range");
+    return make_int(root, ints_max(argv[0]->ints + start, n));
+}
+
+// (array-scale <array> <integer>)
+static Obj *prim_array_scale(void *root, Obj **env, int argc, Obj **argv) {
+    array_arg("array-scale", argv[0]);
+    int k = int_arg("array-scale", argv[1]);
+    Obj *arr = make_array(root, argv[0]->nelems, 0);
+    if (!ints_scale(arr->ints, argv[0]->ints, arr->nelems, k))
+        error("Integer overflow");
+    return arr;
+}
+
+// (array-add <array> <array>)
+static Obj *prim_array_add(void *root, Obj **env, int argc, Obj **argv) {
+    array_arg("array-add", argv[0]);
+    array_arg("array-add", argv[1]);
+    if (argv[0]->nelems != argv[1]->nelems)
+        error("Malformed array-add");
+    Obj *arr = make_array(root, argv[0]->nelems, 0);
+    if (!ints_add(arr->ints, argv[0]->ints, argv[1]->ints, arr->nelems))
+        error("Integer overflow");
+    return arr;
+}
+
+// (array-dot <array> <array>)
+static Obj *prim_array_dot(void *root, Obj **env, int argc, Obj **argv) {
+    array_arg("array-dot", argv[0]);
+    array_arg("array-dot", argv[1]);
+    if (argv[0]->nelems != argv[1]->nelems)
+        error("Malformed array-dot");
+    int32_t dot;
+    if (!ints_dot(argv[0]->ints, argv[1]->ints, argv[0]->nelems, &dot))
+        error("Integer overflow");
+    return make_int(root, dot);
+}
+
+// Checks that the argument of the primitive is a string or a byte buffer.
+static void text_arg(const char *name, Obj *obj) {
+    if (obj_type(obj) != TSTRING && obj_type(obj) != TBYTES)
+        error("Malformed %s", name);
+}
+
+// (string-length <string>)
+static Obj *prim_string_length(void *root, Obj **env, int argc, Obj **argv) {
+    text_arg("string-length", argv[0]);
+    return make_int(root, argv[0]->len);
+}
+
+// (string-ref <string> <integer>)
+static Obj *prim_string_ref(void *root, Obj **env, int argc, Obj **argv) {
+    text_arg("string-ref", argv[0]);
+    int i = int_arg("string-ref", argv[1]);
+    if (i < 0 || i >= argv[0]->len)
+        error("Index out of range: %d", i);
+    return make_int(root, (uint8_t)string_bytes(argv[0])[i]);
+}
+
+// (substring <string> <integer> <integer>)
+static Obj *prim_substring(void *root, Obj **env, int argc, Obj **argv) {
+    text_arg("substring", argv[0]);
+    int start = int_arg("substring", argv[1]);
+    int end = argc == 3 ? int_arg("substring", argv[2]) : argv[0]->len;
+    if (start < 0 || end > argv[0]->len || start > end)
+        error("Malformed substring");
+    return make_slice(root, argv[0]->type, &argv[0], start, end - start);
+}
+
+// (string= <string> <string>)
+static Obj *prim_string_eq(void *root, Obj **env, int argc, Obj **argv) {
+    text_arg("string=", argv[0]);
+    text_arg("string=", argv[1]);
+    bool eq = argv[0]->len == argv[1]->len &&
+              memcmp(string_bytes(argv[0]), string_bytes(argv[1]), argv[0]->len) == 0;
+    return eq ? True : Nil;
+}
+
+// Returns true if the name reads back as the symbol, see read_expr().
+static bool is_symbol_name(const char *name) {
+    if (name[0] == '\0' || isdigit((unsigned char)name[0]))
+        return false;
+    if (name[0] == '-' && isdigit((unsigned char)name[1]))
+        return false;
+    for (const char *p = name; *p; p++)
+        if (!isalnum((unsigned char)*p) && !strchr(symbol_chars, *p))
+            return false;
+    return true;
+}
+
+// (string->symbol <string>)
+//
+// The name must read back as the symbol, so that it prints as one.
+static Obj *prim_string_to_symbol(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TSTRING)
+        error("Malformed string->symbol");
+    int len = argv[0]->len;
+    if (SYMBOL_MAX_LEN <= len)
+        error("Symbol name too long");
+    char buf[SYMBOL_MAX_LEN];
+    memcpy(buf, string_bytes(argv[0]), len);
+    buf[len] = '\0';
+    if ((int)strlen(buf) != len || !is_symbol_name(buf))
+        error("Malformed string->symbol");
+    return intern(root, buf);
+}
+
+// (symbol->string <symbol>)
+static Obj *prim_symbol_to_string(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TSYMBOL)
+        error("Malformed symbol->string");
+    Obj *str = make_text(root, TSTRING, NULL, strlen(argv[0]->name));
+    memcpy(str->bytes, argv[0]->name, str->len);
+    return str;
+}
+
+// (bytes <integer> ...)
+static Obj *prim_bytes(void *root, Obj **env, int argc, Obj **argv) {
+    for (int i = 0; i < argc; i++)
+        if (obj_type(argv[i]) != TINT || int_value(argv[i]) < 0 || int_value(argv[i]) > 255)
+            error("Malformed bytes");
+    Obj *buf = make_text(root, TBYTES, NULL, argc);
+    for (int i = 0; i < argc; i++)
+        buf->bytes[i] = (char)int_value(argv[i]);
+    return buf;
+}
+
+// (string->bytes <string>)
+static Obj *prim_string_to_bytes(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TSTRING)
+        error("Malformed string->bytes");
+    return make_slice(root, TBYTES, &argv[0], 0, argv[0]->len);
+}
+
+// (bytes->string <bytes>)
+static Obj *prim_bytes_to_string(void *root, Obj **env, int argc, Obj **argv) {
+    if (obj_type(argv[0]) != TBYTES)
+        error("Malformed bytes->string");
+    return make_slice(root, TSTRING, &argv[0], 0, argv[0]->len);
+}
+
+// Tables are hashed with open addressing and linear probing. Integers are hashed by value and
+// symbols by name, which do not change. Any other key is hashed by address, which changes when a
+// collection moves the object, so a table holding such keys is rehashed the first time it's used
+// after a collection. While an incremental collection is in progress, the objects move as the
+// interpreter reads them, so these keys are searched for one entry after another instead.
+
+static bool is_hashed_by_address(Obj *key) {
+    return obj_type(key) != TINT && key->type != TSYMBOL;
+}
+
+static uint32_t key_hash(Obj *key) {
+    uint32_t hash;
+    if (obj_type(key) == TINT)
+        hash = (uint32_t)int_value(key) * 2654435761u;
+    else if (key->type == TSYMBOL)
+        hash = key->hash;
+    else
+        hash = (uint32_t)((uintptr_t)key / sizeof(Ref)) * 2654435761u;
+    return hash ^ (hash >> 16);
+}
+
+// Keys are compared with eq, except that integers are compared by value.
+static bool key_eq(Obj *x, Obj *y) {
+    return x == y || (obj_type(x) == TINT && obj_type(y) == TINT && int_value(x) == int_value(y));
+}
+
+// Returns the index of the entry of the table holding the key, or -1 if there is none. In the latter
+// case, *free is set to the index of the first entry that can take the key.
+static int table_find(Obj *table, Obj *key, int *free) {
+    Obj *entries = ENTRIES(table);
+    int mask = entries->nelems / 2 - 1;
+    bool search_all = false;
+#if LISP_INCREMENTAL_GC
+    search_all = incremental_gc_running && is_hashed_by_address(key);
+#endif
+    if (search_all)
+        for (int i = 0; i <= mask; i++)
+            if (key_eq(ELEM(entries, i * 2), key))
+                return i;
+
+    // There is always a free entry, see prim_table_set().
+    *free = -1;
+    for (int i = key_hash(key) & mask;; i = (i + 1) & mask) {
+        Obj *k = ELEM(entries, i * 2);
+        if (k == Cparen) {
+            if (*free < 0)
+                *free = i;
+            return -1;
+        }
+        if (k == Dot) {
+            if (*free < 0)
+                *free = i;
+        } else if (!search_all && key_eq(k, key)) {
+            return i;
+        }
+    }
+}
+
+// Moves the entries of the table to new ones of the given capacity, which must be a power of 2,
+// hashing the keys again and dropping the deleted entries.
+static void table_resize(void *root, Obj **table, int capacity) {
+    DEFINE2(entries, old);
+    *entries = make_vector(root, capacity * 2, &Cparen);
+    *old = ENTRIES(*table);
+    SET_ENTRIES(*table, *entries);
+    write_barrier(*table, *entries);
+    (*table)->nused = (*table)->nentries;
+    (*table)->epoch = gc_epoch;
+    (*table)->flags &= ~FLAG_ADDRESS_KEYS;
+    int mask = capacity - 1;
+    for (int i = 0; i < (*old)->nelems; i += 2) {
+        Obj *key = ELEM(*old, i);
+        if (key == Cparen || key == Dot)
+            continue;
+        // The keys are known to be distinct, the first unused entry takes the key.
+        int j = key_hash(key) & mask;
+        while (ELEM(*entries, j * 2) != Cparen)
+            j = (j + 1) & mask;
+        Obj *val = ELEM(*old, i + 1);
+        SET_ELEM(*entries, j * 2, key);
+        SET_ELEM(*entries, j * 2 + 1, val);
+        write_barrier(*entries, key);
+        write_barrier(*entries, val);
+        if (is_hashed_by_address(key))
+            (*table)->flags |= FLAG_ADDRESS_KEYS;
+    }
+}
+
+// Checks that the argument of the primitive is a table, and rehashes it if a collection has moved
+// its keys since they were hashed.
+static void table_arg(void *root, const char *name, Obj **table) {
+    if (obj_type(*table) != TTABLE)
+        error("Malformed %s", name);
+    if (((*table)->flags & FLAG_ADDRESS_KEYS) && (*table)->epoch != gc_epoch)
+        table_resize(root, table, ENTRIES(*table)->nelems / 2);
+}
+
+// (make-table <integer>)
+static Obj *prim_make_table(void *root, Obj **env, int argc, Obj **argv) {
+    int n = argc == 1 ? int_arg("make-table", argv[0]) : 0;
+    if (n < 0 || n > INT_MAX / 8 / (int)sizeof(Ref))
+        error("Malformed make-table");
+    int capacity = 8;
+    while (capacity / 4 * 3 < n)
+        capacity *= 2;
+    return make_table(root, capacity);
+}
+
+// (table-get <table> expr expr)
+static Obj *prim_table_get(void *root, Obj **env, int argc, Obj **argv) {
+    table_arg(root, "table-get", &argv[0]);
+    int free;
+    int i = table_find(argv[0], argv[1], &free);
+    if (i < 0)
+        return argc == 3 ? argv[2] : Nil;
+    return ELEM(ENTRIES(argv[0]), i * 2 + 1);
+}
+
+// (table-set! <table> expr expr)
+static Obj *prim_table_set(void *root, Obj **env, int argc, Obj **argv) {
+    table_arg(root, "table-set!", &argv[0]);
+    if (argv[1] == Cparen || argv[1] == Dot)
+        error("Malformed table-set!");
+    int free;
+    int i = table_find(argv[0], argv[1], &free);
+    if (i < 0) {
+        // Keep at least a quarter of the entries free, so that the probes stay short.
+        int capacity = ENTRIES(argv[0])->nelems / 2;
+        if ((argv[0]->nused + 1) * 4 > capacity * 3) {
+            if ((argv[0]->nentries + 1) * 2 > capacity)
+                capacity *= 2;
+            table_resize(root, &argv[0], capacity);
+            table_find(argv[0], argv[1], &free);
+        }
+        Obj *entries = ENTRIES(argv[0]);
+        if (ELEM(entries, free * 2) == Cparen)
+            argv[0]->nused++;
+        argv[0]->nentries++;
+        SET_ELEM(entries, free * 2, argv[1]);
+        write_barrier(entries, argv[1]);
+        if (is_hashed_by_address(argv[1]))
+            argv[0]->flags |= FLAG_ADDRESS_KEYS;
+        i = free;
+    }
+    Obj *entries = ENTRIES(argv[0]);
+    SET_ELEM(entries, i * 2 + 1, argv[2]);
+    write_barrier(entries, argv[2]);
+    return argv[2];
+}
+
+// (table-del! <table> expr)
+static Obj *prim_table_del(void *root, Obj **env, int argc, Obj **argv) {
+    table_arg(root, "table-del!", &argv[0]);
+    int free;
+    int i = table_find(argv[0], argv[1], &free);
+    if (i < 0)
+        return Nil;
+    Obj *entries = ENTRIES(argv[0]);
+    SET_ELEM(entries, i * 2, Dot);
+    SET_ELEM(entries, i * 2 + 1, Nil);
+    argv[0]->nentries--;
+    return True;
+}
+
+// (table-keys <table>)
+static Obj *prim_table_keys(void *root, Obj **env, int argc, Obj **argv) {
+    table_arg(root, "table-keys", &argv[0]);
+    DEFINE2(keys, key);
+    *keys = Nil;
+    for (int i = 0; i < ENTRIES(argv[0])->nelems; i += 2) {
+        *key = ELEM(ENTRIES(argv[0]), i);
+        if (*key != Cparen && *key != Dot)
+            *keys = cons(root, key, keys);
+    }
+    return *keys;
+}
+
+// (table-count <table>)
+static Obj *prim_table_count(void *root, Obj **env, int argc, Obj **argv) {
+    table_arg(root, "table-count", &argv[0]);
+    return make_int(root, argv[0]->nentries);
+}
+
+// (if expr expr expr ...)
+static Obj *prim_if(void *root, Obj **env, Obj **list) {
+    if (length(*list) < 2)
+        error("Malformed if");
+    DEFINE3(cond, then, els);
+    *cond = CAR(*list);
+    *cond = eval(root, env, cond);
+    if (*cond != Nil) {
+        *then = CAR(CDR(*list));
+        return eval(root, env, then);
+    }
+    *els = CDR(CDR(*list));
+    return *els == Nil ? Nil : progn(root, env, els);
+}
+
+static Obj *logical_not(Obj *arg);
+
+// (not expr)
+static Obj *prim_not(void *root, Obj **env, int argc, Obj **argv) {
+    return logical_not(argv[0]);
+}
+
+static Obj *logical_not(Obj *arg) {
+    if (obj_type(arg) == TTRUE)
+        return Nil;
+    if (obj_type(arg) == TNIL)
+        return True;
+    if (obj_type(arg) != TINT)
+        error("not takes only boolean and int values");
+
+    const bool val = (bool)int_value(arg);
+    return val ? Nil : True;
+}
+
+// (abs <integer>)
+static Obj *prim_abs(void *root, Obj **env, int argc, Obj **argv) {
+    Obj *arg = argv[0];
+    if (obj_type(arg) != TINT)
+        error("abs takes only numbers");
+
+    const int ret = int_value(arg) < 0 ? -int_value(arg) : int_value(arg);
+    return make_int(root, ret);
+}
+
+// (and expr expr ..)
+static Obj *prim_and(void *root, Obj **env, int argc, Obj **argv) {
+    for (int i = 0; i < argc; i++) {
+        if (obj_type(argv[i]) == TNIL)
+            return Nil;
+        if (obj_type(argv[i]) == TTRUE)
             continue;
-        if (args->car->type != TINT)
+        if (obj_type(argv[i]) != TINT)
             error("and takes only boolean and int values");
-        if (! (bool)args->car->value)
+        if (! (bool)int_value(argv[i]))
             return Nil;
     }
 
@@ -1098,51 +3384,46 @@ static Obj *prim_and(void *root, Obj **env, Obj **list) {
 }
 
 // (or expr expr ..)
-static Obj *prim_or(void *root, Obj **env, Obj **list) {
-    if (length(*list) < 2)
-        error("Malformed or");
-
+static Obj *prim_or(void *root, Obj **env, int argc, Obj **argv) {
     bool current_res = false;
-    for (Obj *args = eval_list(root, env, list); args != Nil; args = args->cdr) {
-        if (args->car->type == TNIL)
+    for (int i = 0; i < argc; i++) {
+        if (obj_type(argv[i]) == TNIL)
             current_res = current_res || false;
-        else if (args->car->type == TTRUE)
+        else if (obj_type(argv[i]) == TTRUE)
             current_res = current_res || true;
-        else if (args->car->type != TINT)
+        else if (obj_type(argv[i]) != TINT)
             error("or takes only boolean and int values");
 
-        current_res = current_res || (bool)args->car->value;
+        current_res = current_res || (bool)int_value(argv[i]);
     }
 
     return current_res ? True : Nil;
 }
 
 // (= <integer|boolean> <integer|boolean>)
-static Obj *prim_num_eq(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2)
-        error("Malformed =");
-    Obj *values = eval_list(root, env, list);
-    Obj *x = values->car;
-    Obj *y = values->cdr->car;
-    if ((x->type != TINT && x->type != TTRUE && x->type != TNIL) ||
-        (y->type != TINT && y->type != TTRUE && y->type != TNIL))
+static Obj *num_eq(Obj *x, Obj *y);
+
+static Obj *prim_num_eq(void *root, Obj **env, int argc, Obj **argv) {
+    return num_eq(argv[0], argv[1]);
+}
+
+static Obj *num_eq(Obj *x, Obj *y) {
+    if ((obj_type(x) != TINT && obj_type(x) != TTRUE && obj_type(x) != TNIL) ||
+        (obj_type(y) != TINT && obj_type(y) != TTRUE && obj_type(y) != TNIL))
         error("= takes only numbers and booleans");
 
-    if (x->type == TINT && y->type == TINT)
-        return x->value == y->value ? True : Nil;
+    if (obj_type(x) == TINT && obj_type(y) == TINT)
+        return int_value(x) == int_value(y) ? True : Nil;
 
-    int x_bool_val = x->type == TINT ? (x->value == 0 ? 0 : 1) : x->type == TTRUE ? 1 : 0;
-    int y_bool_val = y->type == TINT ? (y->value == 0 ? 0 : 1) : y->type == TTRUE ? 1 : 0;
+    int x_bool_val = obj_type(x) == TINT ? (int_value(x) == 0 ? 0 : 1) : obj_type(x) == TTRUE ? 1 : 0;
+    int y_bool_val = obj_type(y) == TINT ? (int_value(y) == 0 ? 0 : 1) : obj_type(y) == TTRUE ? 1 : 0;
 
     return x_bool_val == y_bool_val ? True : Nil;
 }
 
 // (eq expr expr)
-static Obj *prim_eq(void *root, Obj **env, Obj **list) {
-    if (length(*list) != 2)
-        error("Malformed eq");
-    Obj *values = eval_list(root, env, list);
-    return values->car == values->cdr->car ? True : Nil;
+static Obj *prim_eq(void *root, Obj **env, int argc, Obj **argv) {
+    return argv[0] == argv[1] ? True : Nil;
 }
 
 void add_primitive(void *root, Obj **env, const char *name, Primitive *fn) {
@@ -1152,6 +3433,13 @@ void add_primitive(void *root, Obj **env, const char *name, Primitive *fn) {
     add_variable(root, env, sym, prim);
 }
 
+void add_builtin(void *root, Obj **env, const Builtin *builtin) {
+    DEFINE2(sym, prim);
+    *sym = intern(root, builtin->name);
+    *prim = make_builtin(root, builtin);
+    add_variable(root, env, sym, prim);
+}
+
 void add_constant(void *root, Obj **env, const char *name, Obj **val) {
     DEFINE1(sym);
     *sym = intern(root, name);
@@ -1168,7 +3456,7 @@ void add_constant_int(void *root, Obj **env, const char *name, int value) {
 Obj *get_variable(void *root, Obj **env, const char *name) {
     DEFINE2(sym, bind);
     *sym = intern(root, name);
-    *bind = find(env, *sym);
+    *bind = find(env, *sym, NULL);
     if (!*bind)
         error("Unbound variable %s", name);
 
@@ -1181,67 +3469,1616 @@ void define_constants(void *root, Obj **env) {
     add_constant_int(root, env, "#version", LISP_VERSION);
 }
 
+// Adds a primitive taking expressions to evaluate in the caller's environment as arguments, so that
+// analyse_body() can look into them.
+static void add_expr_primitive(void *root, Obj **env, const char *name, Primitive *fn) {
+    DEFINE2(sym, prim);
+    *sym = intern(root, name);
+    *prim = make_primitive(root, fn);
+    (*prim)->flags |= FLAG_EXPR_ARGS;
+    add_variable(root, env, sym, prim);
+}
+
+// The primitives taking their arguments evaluated, and the number of arguments they take.
+static const Builtin builtins[] = {
+    {"cons", prim_cons, 2, 2},
+    {"car", prim_car, 1, 1},
+    {"cdr", prim_cdr, 1, 1},
+    {"setcar", prim_setcar, 2, 2},
+    {"gensym", prim_gensym, 0, 0},
+    {"+", prim_plus, 0, -1},
+    {"-", prim_minus, 1, -1},
+    {"*", prim_mul, 2, -1},
+    {"/", prim_div, 2, -1},
+    {"%", prim_modulo, 2, 2},
+    {"<", prim_lt, 2, 2},
+    {"<=", prim_lte, 2, 2},
+    {">", prim_gt, 2, 2},
+    {">=", prim_gte, 2, 2},
+    {"=", prim_num_eq, 2, 2},
+    {"eq", prim_eq, 2, 2},
+    {"abs", prim_abs, 1, 1},
+    {"print", prim_print, 0, -1},
+    {"gc", prim_gc, 0, 0},
+    {"gc-stats", prim_gc_stats, 0, 0},
+    {"make-vector", prim_make_vector, 1, 2},
+    {"vector", prim_vector, 0, -1},
+    {"vector-ref", prim_vector_ref, 2, 2},
+    {"vector-set!", prim_vector_set, 3, 3},
+    {"vector-length", prim_vector_length, 1, 1},
+    {"make-array", prim_make_array, 1, 2},
+    {"array", prim_array, 0, -1},
+    {"array-ref", prim_array_ref, 2, 2},
+    {"array-set!", prim_array_set, 3, 3},
+    {"array-length", prim_array_length, 1, 1},
+    {"array-sum", prim_array_sum, 1, 3},
+    {"array-min", prim_array_min, 1, 3},
+    {"array-max", prim_array_max, 1, 3},
+    {"array-scale", prim_array_scale, 2, 2},
+    {"array-add", prim_array_add, 2, 2},
+    {"array-dot", prim_array_dot, 2, 2},
+    {"string-length", prim_string_length, 1, 1},
+    {"string-ref", prim_string_ref, 2, 2},
+    {"substring", prim_substring, 2, 3},
+    {"string=", prim_string_eq, 2, 2},
+    {"string->symbol", prim_string_to_symbol, 1, 1},
+    {"symbol->string", prim_symbol_to_string, 1, 1},
+    {"bytes", prim_bytes, 0, -1},
+    {"string->bytes", prim_string_to_bytes, 1, 1},
+    {"bytes->string", prim_bytes_to_string, 1, 1},
+    {"make-table", prim_make_table, 0, 1},
+    {"table-get", prim_table_get, 2, 3},
+    {"table-set!", prim_table_set, 3, 3},
+    {"table-del!", prim_table_del, 2, 2},
+    {"table-keys", prim_table_keys, 1, 1},
+    {"table-count", prim_table_count, 1, 1},
+    // Implemented to reduce code.
+    // Most of these functions can be implemented using previously declared functions.
+    {"eval", prim_eval, 1, 1},
+    {"list", prim_list, 0, -1},
+    {"not", prim_not, 1, 1},
+    {"and", prim_and, 2, -1},
+    {"or", prim_or, 2, -1},
+};
+
 void define_primitives(void *root, Obj **env) {
     add_primitive(root, env, "quote", prim_quote);
-    add_primitive(root, env, "cons", prim_cons);
-    add_primitive(root, env, "car", prim_car);
-    add_primitive(root, env, "cdr", prim_cdr);
     add_primitive(root, env, "setq", prim_setq);
-    add_primitive(root, env, "setcar", prim_setcar);
-    add_primitive(root, env, "while", prim_while);
-    add_primitive(root, env, "gensym", prim_gensym);
-    add_primitive(root, env, "+", prim_plus);
-    add_primitive(root, env, "-", prim_minus);
-    add_primitive(root, env, "*", prim_mul);
-    add_primitive(root, env, "/", prim_div);
-    add_primitive(root, env, "%", prim_modulo);
-    add_primitive(root, env, "<", prim_lt);
-    add_primitive(root, env, "<=", prim_lte);
-    add_primitive(root, env, ">", prim_gt);
-    add_primitive(root, env, ">=", prim_gte);
+    add_expr_primitive(root, env, "while", prim_while);
     add_primitive(root, env, "define", prim_define);
     add_primitive(root, env, "defun", prim_defun);
     add_primitive(root, env, "defmacro", prim_defmacro);
+    add_primitive(root, env, "defmacro-uncached", prim_defmacro_uncached);
     add_primitive(root, env, "macroexpand", prim_macroexpand);
     add_primitive(root, env, "lambda", prim_lambda);
-    add_primitive(root, env, "if", prim_if);
-    add_primitive(root, env, "=", prim_num_eq);
-    add_primitive(root, env, "eq", prim_eq);
-    add_primitive(root, env, "abs", prim_abs);
-    add_primitive(root, env, "print", prim_print);
-    // Implemented to reduce code.
-    // Most of these functions can be implemented using previously declared functions.
-    add_primitive(root, env, "eval", prim_eval);
-    add_primitive(root, env, "list", prim_list);
-    add_primitive(root, env, "not", prim_not);
-    add_primitive(root, env, "and", prim_and);
-    add_primitive(root, env, "or", prim_or);
+    add_expr_primitive(root, env, "if", prim_if);
+    add_expr_primitive(root, env, "progn", prim_progn);
+    add_primitive(root, env, "let", prim_let);
+    add_primitive(root, env, "cond", prim_cond);
+    add_primitive(root, env, "dotimes", prim_dotimes);
+    add_primitive(root, env, "dolist", prim_dolist);
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+        add_builtin(root, env, &builtins[i]);
+}
+
+//======================================================================
+// Lexical addressing
+//
+// The body of a function is analysed the first time the function is called. The references to the
+// parameters of the function, and of the functions around it, are replaced with TLOCAL objects
+// telling how many frames up the parameter is and in which slot. Looking the value up then takes no
+// symbol comparisons. The analysis waits for the second call, rather than the creation of the
+// function, so that it knows about the functions defined after it, itself included, and so that
+// the lambdas made by a macro expansion and called only once are not analysed in vain.
+//
+// Only the arguments known to be expressions are looked into: those of the calls to functions and
+// to the built-in primitives. Macro calls are left alone, the same symbols may mean something else
+// after the expansion.
+//======================================================================
+
+// Returns the index of the variable in the first nslots names of a frame, or -1. A name is a
+// symbol, or a cell with the symbol in its car, as the bindings of a let are.
+static int name_index(Obj *names, int nslots, Obj *sym) {
+    int i = 0;
+    for (; i < nslots && obj_type(names) == TCELL; names = CDR(names), i++) {
+        Obj *var = CAR(names);
+        if (var == sym || (obj_type(var) == TCELL && CAR(var) == sym))
+            return i;
+    }
+    return names == sym ? i : -1;
+}
+
+// Returns the names of the frame binding the variable, and stores how many frames up and in which
+// slot, or returns null if it's not bound by one. The scope lists the (names . nslots) of the
+// frames the code being analysed runs in, the innermost first, and ends with the environment of
+// the outermost.
+static Obj *resolve(Obj *scope, Obj *sym, int *depth, int *slot) {
+    *depth = 0;
+    for (; obj_type(scope) == TCELL; scope = CDR(scope), ++*depth) {
+        Obj *entry = CAR(scope);
+        if ((*slot = name_index(CAR(entry), int_value(CDR(entry)), sym)) >= 0)
+            return CAR(entry);
+    }
+    for (; scope != Nil && scope != Globals; scope = UP(scope), ++*depth)
+        if ((*slot = name_index(NAMES(scope), scope->nslots, sym)) >= 0)
+            return NAMES(scope);
+    return NULL;
+}
+
+// Returns the scope extended with a frame of nslots variables named by names.
+static Obj *push_scope(void *root, Obj **scope, Obj **names, int nslots) {
+    DEFINE2(entry, n);
+    *n = make_fixnum(nslots);
+    *entry = cons(root, names, n);
+    return cons(root, entry, scope);
+}
+
+// Returns the reference to the variable if it's a parameter, or the symbol otherwise. The
+// references already made are kept in the list made, and shared.
+static Obj *analyse_var(void *root, Obj **scope, Obj **made, Obj **sym) {
+    int depth, slot;
+    Obj *binder = resolve(*scope, *sym, &depth, &slot);
+    if (!binder || depth > UINT16_MAX || slot > UINT16_MAX)
+        return *sym;
+    for (Obj *p = *made; p != Nil; p = CDR(p)) {
+        Obj *local = CAR(p);
+        if (VAR(local) == *sym && BINDER(local) == binder && local->depth == depth)
+            return local;
+    }
+    DEFINE2(local, tmp);
+    *tmp = binder;
+    *local = make_local(root, sym, tmp, depth, slot);
+    *made = cons(root, local, made);
+    return *local;
+}
+
+// Returns the expression with the references to the parameters replaced.
+static Obj *analyse_expr(void *root, Obj **scope, Obj **made, Obj **expr) {
+    switch (obj_type(*expr)) {
+    case TSYMBOL:
+        return analyse_var(root, scope, made, expr);
+    case TLOCAL: {
+        DEFINE1(sym);
+        *sym = VAR(*expr);
+        return analyse_var(root, scope, made, sym);
+    }
+    case TCELL:
+        analyse_form(root, scope, made, expr);
+        return compile_form(root, expr);
+    default:
+        return *expr;
+    }
+}
+
+// Stores the analysed expression in place of the one in the car of the cell. The sealed code is
+// left as it is: it has been analysed by lisp_seal() already, or runs unanalysed, since a pointer
+// from it to the heap would stay in the remembered set for good.
+static void rewrite_car(Obj *cell, Obj *expr) {
+    if (is_sealed(cell))
+        return;
+    SET_CAR(cell, expr);
+    write_barrier(cell, expr);
+}
+
+// Analyses every expression of the list in place.
+static void analyse_list(void *root, Obj **scope, Obj **made, Obj **list) {
+    DEFINE2(lp, expr);
+    for (*lp = *list; obj_type(*lp) == TCELL; *lp = CDR(*lp)) {
+        *expr = CAR(*lp);
+        *expr = analyse_expr(root, scope, made, expr);
+        rewrite_car(*lp, *expr);
+    }
+}
+
+// Analyses the body of (<params> expr ...), the rest of a lambda expression, in the scope extended
+// with the parameters.
+static void analyse_lambda(void *root, Obj **scope, Obj **made, Obj **list) {
+    if (obj_type(*list) != TCELL || obj_type(CDR(*list)) != TCELL)
+        return;
+    DEFINE2(inner, body);
+    *body = CDR(*list);
+    if ((*body)->flags & FLAG_ANALYSED)
+        return;
+    (*body)->flags |= FLAG_ANALYSED;
+    *inner = CAR(*list);
+    *inner = push_scope(root, scope, inner, count_params(*inner));
+    analyse_list(root, inner, made, body);
+}
+
+// Analyses (<bindings> expr ...), the rest of a let: the values in the scope, the body in the scope
+// extended with the variables.
+static void analyse_let(void *root, Obj **scope, Obj **made, Obj **list) {
+    int n = obj_type(*list) == TCELL ? count_bindings(CAR(*list)) : -1;
+    if (n < 0)
+        return;
+    DEFINE3(lp, value, inner);
+    for (*lp = CAR(*list); *lp != Nil; *lp = CDR(*lp)) {
+        binding_var(CAR(*lp))->flags |= FLAG_LOCAL_NAME;
+        if (obj_type(CAR(*lp)) == TCELL) {
+            *value = CDR(CAR(*lp));
+            analyse_list(root, scope, made, value);
+        }
+    }
+    *inner = CAR(*list);
+    *inner = push_scope(root, scope, inner, n);
+    *lp = CDR(*list);
+    analyse_list(root, inner, made, lp);
+}
+
+// Analyses ((<symbol> expr [expr]) expr ...), the rest of a dotimes or a dolist: the count or the
+// list in the scope, the rest in the scope extended with the variable.
+static void analyse_loop(void *root, Obj **scope, Obj **made, Obj **list) {
+    if (!loop_ok(*list))
+        return;
+    CAR(CAR(*list))->flags |= FLAG_LOCAL_NAME;
+    DEFINE3(lp, expr, inner);
+    *lp = CDR(CAR(*list));
+    *expr = CAR(*lp);
+    *expr = analyse_expr(root, scope, made, expr);
+    rewrite_car(*lp, *expr);
+    *inner = push_scope(root, scope, list, 1);
+    *lp = CDR(*lp);
+    analyse_list(root, inner, made, lp);
+    *lp = CDR(*list);
+    analyse_list(root, inner, made, lp);
+}
+
+// Analyses every expression of the clauses of a cond.
+static void analyse_clauses(void *root, Obj **scope, Obj **made, Obj **list) {
+    DEFINE2(lp, clause);
+    for (*lp = *list; obj_type(*lp) == TCELL; *lp = CDR(*lp)) {
+        *clause = CAR(*lp);
+        analyse_list(root, scope, made, clause);
+    }
+}
+
+// Analyses the arguments of the form, as far as they are known to be expressions.
+static void analyse_form(void *root, Obj **scope, Obj **made, Obj **form) {
+    DEFINE3(head, args, env);
+    *head = CAR(*form);
+    *args = CDR(*form);
+    if (obj_type(*head) != TSYMBOL) {
+        // A function computed by an expression
+        *head = analyse_expr(root, scope, made, head);
+        rewrite_car(*form, *head);
+        analyse_list(root, scope, made, args);
+        return;
+    }
+    Obj *local = analyse_var(root, scope, made, head);
+    if (local != *head) {
+        // A function passed as an argument
+        rewrite_car(*form, local);
+        analyse_list(root, scope, made, args);
+        return;
+    }
+    for (*env = *scope; obj_type(*env) == TCELL; *env = CDR(*env))
+        ;
+    Obj *fn = lookup(env, *head);
+    if (!fn)
+        return;
+    if (obj_type(fn) == TFUNCTION) {
+        analyse_list(root, scope, made, args);
+    } else if (obj_type(fn) == TPRIMITIVE) {
+        if ((fn->flags & FLAG_EXPR_ARGS) || fn->fn == prim_setq) {
+            analyse_list(root, scope, made, args);
+        } else if (fn->fn == prim_lambda) {
+            analyse_lambda(root, scope, made, args);
+        } else if (fn->fn == prim_let) {
+            analyse_let(root, scope, made, args);
+        } else if (fn->fn == prim_dotimes || fn->fn == prim_dolist) {
+            analyse_loop(root, scope, made, args);
+        } else if (fn->fn == prim_cond) {
+            analyse_clauses(root, scope, made, args);
+        } else if (fn->fn == prim_defun || fn->fn == prim_defmacro || fn->fn == prim_defmacro_uncached) {
+            if (obj_type(*args) == TCELL) {
+                *args = CDR(*args);
+                analyse_lambda(root, scope, made, args);
+            }
+        } else if (fn->fn == prim_define) {
+            // Only the value, the symbol defined is not a reference
+            if (obj_type(*args) == TCELL) {
+                *args = CDR(*args);
+                analyse_list(root, scope, made, args);
+            }
+        }
+    }
+}
+
+// Analyses the body of the function, see above.
+static void analyse_body(void *root, Obj **fn) {
+    DEFINE3(scope, made, body);
+    *body = BODY(*fn);
+    (*body)->flags |= FLAG_ANALYSED;
+    *scope = PARAMS(*fn);
+    *made = ENV(*fn);
+    *scope = push_scope(root, made, scope, count_params(*scope));
+    *made = Nil;
+    analyse_list(root, scope, made, body);
+}
+
+//======================================================================
+// Compiled forms
+//
+// A form of an analysed function body is replaced with a TNODE, which holds the form and a handler
+// made for its kind: a call, an if, or one of the common primitives with fixed arguments. Running
+// the handler skips the checks and the lookups eval() does for a form, and the primitives get their
+// arguments without a list being consed. The handler of a primitive checks that its name is still
+// bound to it, and evaluates the form as a call otherwise.
+//======================================================================
+
+// Returns the global value of the head of the form, or null if it's not bound or may be shadowed.
+static inline Obj *head_value(Obj *form) {
+    Obj *sym = CAR(form);
+    if (obj_type(sym) != TSYMBOL || (sym->flags & FLAG_LOCAL_NAME))
+        return NULL;
+    Obj *bind = GLOBAL(sym);
+    return bind == Nil ? NULL : CDR(bind);
+}
+
+// Returns true if the head of the form is bound to the given primitive.
+static inline bool head_is(Obj *form, Primitive *fn) {
+    Obj *val = head_value(form);
+    return val && obj_type(val) == TPRIMITIVE && !(val->flags & FLAG_BUILTIN) && val->fn == fn;
+}
+
+// Returns true if the head of the form is bound to the builtin with the given function.
+static inline bool head_is_builtin(Obj *form, BuiltinFn *fn) {
+    Obj *val = head_value(form);
+    return val && obj_type(val) == TPRIMITIVE && (val->flags & FLAG_BUILTIN) && val->builtin->fn == fn;
+}
+
+// (fn expr ...)
+static Obj *node_call(void *root, Obj **env, Obj **node) {
+    DEFINE3(form, fn, frame);
+    *form = FORM(*node);
+    Obj *val = eval_tail(root, env, form, fn, frame);
+    return val ? val : run_body(root, fn, frame);
+}
+
+// (if cond then else ...)
+static Obj *node_if(void *root, Obj **env, Obj **node) {
+    DEFINE2(form, expr);
+    *form = FORM(*node);
+    if (!head_is(*form, prim_if))
+        return node_call(root, env, node);
+    *expr = CAR(CDR(*form));
+    if (eval_compiled(root, env, expr) != Nil) {
+        *expr = CAR(CDR(CDR(*form)));
+        return eval_compiled(root, env, expr);
+    }
+    *expr = CDR(CDR(CDR(*form)));
+    return *expr == Nil ? Nil : progn(root, env, expr);
+}
+
+// Evaluates the argument of the form in *x, and the second one, if any, in *y.
+static void eval_args(void *root, Obj **env, Obj *form, Obj **x, Obj **y) {
+    DEFINE1(args);
+    *args = CDR(form);
+    *x = CAR(*args);
+    *x = eval_compiled(root, env, x);
+    if (y) {
+        *y = CAR(CDR(*args));
+        *y = eval_compiled(root, env, y);
+    }
+}
+
+// Defines the handler of a primitive taking two numbers. The result is computed from the int values
+// a and b.
+#define DEFINE_ARITH_NODE(name, prim, msg, result)                        \
+    static Obj *name(void *root, Obj **env, Obj **node) {                 \
+        if (!head_is_builtin(FORM(*node), prim))                          \
+            return node_call(root, env, node);                            \
+        DEFINE2(x, y);                                                    \
+        eval_args(root, env, FORM(*node), x, y);                          \
+        if (obj_type(*x) != TINT || obj_type(*y) != TINT)                 \
+            error(msg);                                                   \
+        int a = int_value(*x), b = int_value(*y);                         \
+        return result;                                                    \
+    }
+
+DEFINE_ARITH_NODE(node_plus, prim_plus, "+ takes only numbers", make_int(root, a + b))
+DEFINE_ARITH_NODE(node_minus, prim_minus, "- takes only numbers", make_int(root, a - b))
+DEFINE_ARITH_NODE(node_lt, prim_lt, "< takes only numbers", a < b ? True : Nil)
+DEFINE_ARITH_NODE(node_lte, prim_lte, "<= takes only numbers", a <= b ? True : Nil)
+DEFINE_ARITH_NODE(node_gt, prim_gt, "> takes only numbers", a > b ? True : Nil)
+DEFINE_ARITH_NODE(node_gte, prim_gte, ">= takes only numbers", a >= b ? True : Nil)
+
+// (= expr expr)
+static Obj *node_num_eq(void *root, Obj **env, Obj **node) {
+    if (!head_is_builtin(FORM(*node), prim_num_eq))
+        return node_call(root, env, node);
+    DEFINE2(x, y);
+    eval_args(root, env, FORM(*node), x, y);
+    return num_eq(*x, *y);
+}
+
+// (eq expr expr)
+static Obj *node_eq(void *root, Obj **env, Obj **node) {
+    if (!head_is_builtin(FORM(*node), prim_eq))
+        return node_call(root, env, node);
+    DEFINE2(x, y);
+    eval_args(root, env, FORM(*node), x, y);
+    return *x == *y ? True : Nil;
+}
+
+// (cons expr expr)
+static Obj *node_cons(void *root, Obj **env, Obj **node) {
+    if (!head_is_builtin(FORM(*node), prim_cons))
+        return node_call(root, env, node);
+    DEFINE2(x, y);
+    eval_args(root, env, FORM(*node), x, y);
+    return cons(root, x, y);
+}
+
+// (car expr)
+static Obj *node_car(void *root, Obj **env, Obj **node) {
+    if (!head_is_builtin(FORM(*node), prim_car))
+        return node_call(root, env, node);
+    DEFINE1(x);
+    eval_args(root, env, FORM(*node), x, NULL);
+    if (obj_type(*x) != TCELL)
+        error("Malformed car");
+    return CAR(*x);
+}
+
+// (cdr expr)
+static Obj *node_cdr(void *root, Obj **env, Obj **node) {
+    if (!head_is_builtin(FORM(*node), prim_cdr))
+        return node_call(root, env, node);
+    DEFINE1(x);
+    eval_args(root, env, FORM(*node), x, NULL);
+    if (obj_type(*x) != TCELL)
+        error("Malformed cdr");
+    return CDR(*x);
+}
+
+// (not expr)
+static Obj *node_not(void *root, Obj **env, Obj **node) {
+    if (!head_is_builtin(FORM(*node), prim_not))
+        return node_call(root, env, node);
+    DEFINE1(x);
+    eval_args(root, env, FORM(*node), x, NULL);
+    return logical_not(*x);
+}
+
+// The primitives with a handler of their own, and the number of arguments it takes.
+static const struct {
+    BuiltinFn *prim;
+    int nargs;
+    Primitive *handler;
+} node_handlers[] = {
+    {prim_plus, 2, node_plus},
+    {prim_minus, 2, node_minus},
+    {prim_lt, 2, node_lt},
+    {prim_lte, 2, node_lte},
+    {prim_gt, 2, node_gt},
+    {prim_gte, 2, node_gte},
+    {prim_num_eq, 2, node_num_eq},
+    {prim_eq, 2, node_eq},
+    {prim_cons, 2, node_cons},
+    {prim_car, 1, node_car},
+    {prim_cdr, 1, node_cdr},
+    {prim_not, 1, node_not},
+};
+
+// Returns a node evaluating the analysed form, or the form itself if it is not to be compiled.
+static Obj *compile_form(void *root, Obj **form) {
+    Primitive *handler = NULL;
+    Obj *fn = head_value(*form);
+    if (obj_type(CAR(*form)) == TLOCAL || (fn && obj_type(fn) == TFUNCTION)) {
+        handler = node_call;
+    } else if (fn && obj_type(fn) == TPRIMITIVE) {
+        int nargs = length(CDR(*form));
+        bool builtin = fn->flags & FLAG_BUILTIN;
+        if (!builtin && fn->fn == prim_if && nargs >= 2)
+            handler = node_if;
+        for (size_t i = 0; builtin && !handler && i < sizeof(node_handlers) / sizeof(node_handlers[0]); i++)
+            if (fn->builtin->fn == node_handlers[i].prim && nargs == node_handlers[i].nargs)
+                handler = node_handlers[i].handler;
+        if (!handler && (fn->flags & FLAG_EXPR_ARGS))
+            handler = node_call;
+    }
+    return handler ? make_node(root, handler, form) : *form;
+}
+
+//======================================================================
+// Bytecode
+//
+// lisp_compile() lowers an expression to bytecode for a stack machine. Its operands are kept on
+// the root stack, on top of the roots of the caller, and a call from compiled code to a compiled
+// function pushes a record of REC_SIZE slots instead of recursing in C. A deep recursion then
+// takes a fraction of the C stack and of the root stack the tree walker needs for it.
+//
+// The lambdas of the expression are compiled along with it, into functions whose body is a single
+// TCODE, so that the tree walker can call them like any other. Macro calls are expanded as they
+// are compiled. The special forms and the primitives with an instruction of their own are guarded
+// like the compiled forms above. The forms the compiler does not handle, the calls that turn out
+// to be macro calls, and the calls to the primitives that do not evaluate all their arguments are
+// evaluated by eval(). Compiled code thus behaves the same as the forms it was compiled from.
+//======================================================================
+
+// The instructions. The operands follow the opcode in single bytes: k is the index of a constant,
+// n is a byte count taking two bytes, the low one first.
+enum
+{
+    OP_CONST,     // k: pushes the constant
+    OP_NIL,       // pushes ()
+    OP_TRUE,      // pushes #t
+    OP_LOCAL,     // depth slot: pushes the slot of the frame depth levels up
+    OP_SET_LOCAL, // depth slot: stores the top to the slot of the frame depth levels up
+    OP_LOOKUP,    // k: pushes the value of the variable named by the constant
+    OP_POP,       // drops the top
+    OP_JUMP,      // n: skips n bytes
+    OP_LOOP,      // n: goes n bytes back from the end of the instruction
+    OP_JUMP_NIL,  // n: pops the top, and skips n bytes if it's ()
+    OP_ENTER,     // k n: if the function on top does not take evaluated arguments, replaces it
+                  // with the value of the form k and skips n bytes
+    OP_CALL,      // count: replaces the function and the arguments on top with its value
+    OP_TAIL_CALL, // count: same as OP_CALL, but a compiled function replaces the running call
+    OP_GUARD,     // i k n: unless the form k is a call to vm_prims[i], pushes its value and skips
+                  // n bytes
+    OP_PRIM,      // i: replaces the arguments on top with the value of vm_prims[i]
+    OP_EVAL,      // k: pushes the value of the form
+    OP_CLOSURE,   // k: pushes a function made of the constant (params . body)
+    OP_CHECK_NEW, // k: reports an error if the symbol is already defined
+    OP_DEFINE,    // k: binds the symbol to the value on top
+    OP_WHILE,     // starts a loop, pushing the binding of #itr and the iteration count
+    OP_NEXT,      // counts an iteration of the loop
+    OP_DONE,      // replaces the binding and the count on top with ()
+    OP_BIND,      // k count: replaces the values on top with a frame binding them to the names in
+                  // the constant, which the code runs in from then on
+    OP_UNBIND,    // goes back to the frame the current one was made in
+    OP_RETURN,    // returns the top to the caller
+};
+
+// The primitives compiled to instructions. Those from VM_PLUS on are applied by OP_PRIM to one
+// argument from VM_CAR on, two before.
+enum
+{
+    VM_QUOTE,
+    VM_IF,
+    VM_SETQ,
+    VM_DEFINE,
+    VM_DEFUN,
+    VM_LAMBDA,
+    VM_WHILE,
+    VM_PROGN,
+    VM_LET,
+    VM_COND,
+    VM_PLUS,
+    VM_MINUS,
+    VM_LT,
+    VM_LTE,
+    VM_GT,
+    VM_GTE,
+    VM_NUM_EQ,
+    VM_EQ,
+    VM_CONS,
+    VM_CAR,
+    VM_CDR,
+    VM_NOT,
+    VM_PRIMS,
+};
+
+// The special forms come first, then the builtins.
+static const struct {
+    Primitive *form;
+    BuiltinFn *builtin;
+} vm_prims[VM_PRIMS] = {
+    {prim_quote}, {prim_if}, {prim_setq}, {prim_define}, {prim_defun}, {prim_lambda}, {prim_while},
+    {prim_progn}, {prim_let}, {prim_cond}, {NULL, prim_plus}, {NULL, prim_minus}, {NULL, prim_lt},
+    {NULL, prim_lte}, {NULL, prim_gt}, {NULL, prim_gte}, {NULL, prim_num_eq}, {NULL, prim_eq},
+    {NULL, prim_cons}, {NULL, prim_car}, {NULL, prim_cdr}, {NULL, prim_not},
+};
+
+// Returns true if the primitive is vm_prims[i].
+static bool is_vm_prim(Obj *fn, int i) {
+    return (fn->flags & FLAG_BUILTIN) ? fn->builtin->fn == vm_prims[i].builtin : fn->fn == vm_prims[i].form;
+}
+
+// Returns true if the head of the form is bound to vm_prims[i].
+static bool head_is_vm_prim(Obj *form, int i) {
+    Obj *val = head_value(form);
+    return val && obj_type(val) == TPRIMITIVE && is_vm_prim(val, i);
+}
+
+// The state of the compilation of an expression or a function body.
+typedef struct
+{
+    // The bytes emitted so far as fixnums, the last one first, and their number
+    Obj **bytes;
+    int size;
+    // The constants, the last one first, and their number
+    Obj **consts;
+    int nconsts;
+    // The names of the frames the code being compiled runs in, see resolve()
+    Obj **scope;
+    // Set for the expression to compile next if it's in a tail position
+    bool tail;
+    // Set if the code does not fit the format, e.g. it needs more than 256 constants
+    bool failed;
+} Compiler;
+
+typedef void Emitter(void *root, Compiler *c, Obj **expr);
+
+static void compile_expr(void *root, Compiler *c, Obj **expr);
+
+static void emit(void *root, Compiler *c, int byte) {
+    Obj *val = make_fixnum(byte);
+    *c->bytes = cons(root, &val, c->bytes);
+    c->size++;
+}
+
+static void emit16(void *root, Compiler *c, int n) {
+    if (n > UINT16_MAX)
+        c->failed = true;
+    emit(root, c, n & 0xff);
+    emit(root, c, (n >> 8) & 0xff);
+}
+
+// Returns the index of the constant, which is added unless it's there already.
+static int constant(void *root, Compiler *c, Obj **obj) {
+    int i = c->nconsts - 1;
+    for (Obj *p = *c->consts; p != Nil; p = CDR(p), i--)
+        if (CAR(p) == *obj)
+            return i;
+    if (c->nconsts > UINT8_MAX) {
+        c->failed = true;
+        return 0;
+    }
+    *c->consts = cons(root, obj, c->consts);
+    return c->nconsts++;
+}
+
+// Emits an instruction taking the given constant.
+static void emit_const(void *root, Compiler *c, int op, Obj **obj) {
+    int k = constant(root, c, obj);
+    emit(root, c, op);
+    emit(root, c, k);
+}
+
+// Compiles the expression with the given emitter into *part, kept apart from the code, and returns
+// its size. The part is added to the code by splice(), once the jump over it has been emitted.
+static int compile_part(void *root, Compiler *c, Emitter *fn, Obj **part, Obj **expr) {
+    Obj **bytes = c->bytes;
+    int size = c->size;
+    *part = Nil;
+    c->bytes = part;
+    c->size = 0;
+    fn(root, c, expr);
+    int n = c->size;
+    c->bytes = bytes;
+    c->size = size;
+    return n;
+}
+
+static void splice(Compiler *c, Obj **part, int size) {
+    if (*part == Nil)
+        return;
+    Obj *last = *part;
+    while (CDR(last) != Nil)
+        last = CDR(last);
+    SET_CDR(last, *c->bytes);
+    write_barrier(last, *c->bytes);
+    *c->bytes = *part;
+    c->size += size;
+}
+
+// Compiles the expressions of the list, keeping the value of the last one only. The last one is
+// in a tail position if the list is.
+static void compile_seq(void *root, Compiler *c, Obj **list) {
+    bool tail = c->tail;
+    c->tail = false;
+    if (*list == Nil) {
+        emit(root, c, OP_NIL);
+        return;
+    }
+    DEFINE2(lp, expr);
+    for (*lp = *list; *lp != Nil; *lp = CDR(*lp)) {
+        *expr = CAR(*lp);
+        c->tail = tail && CDR(*lp) == Nil;
+        compile_expr(root, c, expr);
+        if (CDR(*lp) != Nil)
+            emit(root, c, OP_POP);
+    }
+}
+
+// Compiles the expressions of the list for their side effects.
+static void compile_effects(void *root, Compiler *c, Obj **list) {
+    DEFINE2(lp, expr);
+    for (*lp = *list; *lp != Nil; *lp = CDR(*lp)) {
+        *expr = CAR(*lp);
+        compile_expr(root, c, expr);
+        emit(root, c, OP_POP);
+    }
+}
+
+// Compiles the expressions of the list, keeping all the values.
+static void compile_args(void *root, Compiler *c, Obj **list) {
+    DEFINE2(lp, expr);
+    for (*lp = *list; *lp != Nil; *lp = CDR(*lp)) {
+        *expr = CAR(*lp);
+        compile_expr(root, c, expr);
+    }
+}
+
+static void compile_var(void *root, Compiler *c, Obj **sym) {
+    int depth, slot;
+    if (resolve(*c->scope, *sym, &depth, &slot) && depth <= UINT8_MAX && slot <= UINT8_MAX) {
+        emit(root, c, OP_LOCAL);
+        emit(root, c, depth);
+        emit(root, c, slot);
+    } else {
+        emit_const(root, c, OP_LOOKUP, sym);
+    }
+}
+
+static void compile_const(void *root, Compiler *c, Obj **obj) {
+    if (*obj == Nil)
+        emit(root, c, OP_NIL);
+    else if (*obj == True)
+        emit(root, c, OP_TRUE);
+    else
+        emit_const(root, c, OP_CONST, obj);
+}
+
+// Returns the bytecode compiled, or null if it does not fit the format.
+static Obj *assemble(void *root, Compiler *c) {
+    if (c->failed || c->size > UINT16_MAX)
+        return NULL;
+    Obj *code = make_code(root, c->nconsts, c->size);
+    Obj *p = *c->consts;
+    for (int i = c->nconsts - 1; i >= 0; i--, p = CDR(p))
+        SET_CODE_CONST(code, i, CAR(p));
+    uint8_t *bytes = CODE_BYTES(code);
+    p = *c->bytes;
+    for (int i = c->size - 1; i >= 0; i--, p = CDR(p))
+        bytes[i] = int_value(CAR(p));
+    return code;
+}
+
+// Returns true if the rest of a lambda expression, (<params> expr ...), is well-formed.
+static bool lambda_ok(Obj *list) {
+    if (obj_type(list) != TCELL || !is_list(CAR(list)) || length(CDR(list)) <= 0)
+        return false;
+    Obj *p = CAR(list);
+    for (; obj_type(p) == TCELL; p = CDR(p))
+        if (obj_type(CAR(p)) != TSYMBOL)
+            return false;
+    return p == Nil || obj_type(p) == TSYMBOL;
+}
+
+// Compiles the body of (<params> expr ...), the rest of a lambda expression, to bytecode of its
+// own, and emits the instruction making a function of it. The body is left to the tree walker if
+// it does not fit the format.
+static void compile_lambda(void *root, Compiler *c, Obj **list) {
+    DEFINE4(bytes, consts, scope, proto);
+    *bytes = Nil;
+    *consts = Nil;
+    *scope = CAR(*list);
+    *scope = push_scope(root, c->scope, scope, count_params(*scope));
+    Compiler inner = {bytes, 0, consts, 0, scope, true, false};
+    *proto = CDR(*list);
+    compile_seq(root, &inner, proto);
+    emit(root, &inner, OP_RETURN);
+    Obj *code = assemble(root, &inner);
+    if (code) {
+        *proto = code;
+        *proto = cons(root, proto, &Nil);
+        (*proto)->flags |= FLAG_ANALYSED;
+    }
+    *scope = CAR(*list);
+    *proto = cons(root, scope, proto);
+    emit_const(root, c, OP_CLOSURE, proto);
+}
+
+// (if cond then else ...)
+static void compile_if(void *root, Compiler *c, Obj **args, bool tail) {
+    DEFINE3(expr, then, els);
+    *expr = CAR(*args);
+    compile_expr(root, c, expr);
+    *expr = CAR(CDR(*args));
+    c->tail = tail;
+    int then_size = compile_part(root, c, compile_expr, then, expr);
+    *expr = CDR(CDR(*args));
+    c->tail = tail;
+    int else_size = compile_part(root, c, compile_seq, els, expr);
+    emit(root, c, OP_JUMP_NIL);
+    emit16(root, c, then_size + 3);
+    splice(c, then, then_size);
+    emit(root, c, OP_JUMP);
+    emit16(root, c, else_size);
+    splice(c, els, else_size);
+}
+
+// (while cond expr ...)
+static void compile_while(void *root, Compiler *c, Obj **args) {
+    DEFINE2(expr, body);
+    emit(root, c, OP_WHILE);
+    int start = c->size;
+    *expr = CAR(*args);
+    compile_expr(root, c, expr);
+    *expr = CDR(*args);
+    int body_size = compile_part(root, c, compile_effects, body, expr);
+    emit(root, c, OP_JUMP_NIL);
+    emit16(root, c, body_size + 4);
+    splice(c, body, body_size);
+    emit(root, c, OP_NEXT);
+    emit(root, c, OP_LOOP);
+    emit16(root, c, c->size + 2 - start);
+    emit(root, c, OP_DONE);
+}
+
+// (let (<binding> ...) expr ...)
+//
+// Returns false if the form is malformed or binds too many variables. The variables get a frame of
+// their own, as with the tree walker, so that the closures made in the body capture them.
+static bool compile_let(void *root, Compiler *c, Obj **args, bool tail) {
+    int n = obj_type(*args) == TCELL ? count_bindings(CAR(*args)) : -1;
+    if (n < 0 || n > UINT8_MAX || length(CDR(*args)) < 0)
+        return false;
+    DEFINE3(lp, expr, scope);
+    for (*lp = CAR(*args); *lp != Nil; *lp = CDR(*lp)) {
+        binding_var(CAR(*lp))->flags |= FLAG_LOCAL_NAME;
+        if (obj_type(CAR(*lp)) != TCELL || CDR(CAR(*lp)) == Nil) {
+            emit(root, c, OP_NIL);
+            continue;
+        }
+        *expr = CAR(CDR(CAR(*lp)));
+        compile_expr(root, c, expr);
+    }
+    *expr = CAR(*args);
+    emit_const(root, c, OP_BIND, expr);
+    emit(root, c, n);
+    *scope = push_scope(root, c->scope, expr, n);
+    Obj **outer = c->scope;
+    c->scope = scope;
+    *expr = CDR(*args);
+    c->tail = tail;
+    compile_seq(root, c, expr);
+    c->scope = outer;
+    emit(root, c, OP_UNBIND);
+    return true;
+}
+
+// Returns true if the clauses of a cond are well-formed, with an expression after each test.
+static bool clauses_ok(Obj *list) {
+    if (length(list) < 0)
+        return false;
+    for (; list != Nil; list = CDR(list))
+        if (length(CAR(list)) < 2)
+            return false;
+    return true;
+}
+
+// (cond (expr expr ...) ...)
+static void compile_clauses(void *root, Compiler *c, Obj **list, bool tail) {
+    if (*list == Nil) {
+        emit(root, c, OP_NIL);
+        return;
+    }
+    DEFINE3(expr, body, rest);
+    *expr = CAR(CAR(*list));
+    compile_expr(root, c, expr);
+    *expr = CDR(CAR(*list));
+    c->tail = tail;
+    int body_size = compile_part(root, c, compile_seq, body, expr);
+    Obj **bytes = c->bytes;
+    int size = c->size;
+    *rest = Nil;
+    c->bytes = rest;
+    c->size = 0;
+    *expr = CDR(*list);
+    compile_clauses(root, c, expr, tail);
+    int rest_size = c->size;
+    c->bytes = bytes;
+    c->size = size;
+    emit(root, c, OP_JUMP_NIL);
+    emit16(root, c, body_size + 3);
+    splice(c, body, body_size);
+    emit(root, c, OP_JUMP);
+    emit16(root, c, rest_size);
+    splice(c, rest, rest_size);
+}
+
+// Compiles the arguments of a call to vm_prims[i]. Returns false if the form is malformed, and
+// left to the primitive to report.
+static bool compile_prim_args(void *root, Compiler *c, int i, Obj **args, bool tail) {
+    DEFINE2(expr, sym);
+    int nargs = length(*args);
+    int depth, slot;
+    switch (i) {
+    case VM_QUOTE:
+        if (nargs != 1)
+            return false;
+        *expr = CAR(*args);
+        compile_const(root, c, expr);
+        return true;
+    case VM_IF:
+        if (nargs < 2)
+            return false;
+        compile_if(root, c, args, tail);
+        return true;
+    case VM_SETQ:
+        // Only the parameters, the other variables are set by prim_setq()
+        if (nargs != 2 || obj_type(CAR(*args)) != TSYMBOL || CAR(*args)->constant ||
+            !resolve(*c->scope, CAR(*args), &depth, &slot) || depth > UINT8_MAX || slot > UINT8_MAX)
+            return false;
+        *expr = CAR(CDR(*args));
+        compile_expr(root, c, expr);
+        emit(root, c, OP_SET_LOCAL);
+        emit(root, c, depth);
+        emit(root, c, slot);
+        return true;
+    case VM_DEFINE:
+    case VM_DEFUN:
+        if (obj_type(CAR(*args)) != TSYMBOL)
+            return false;
+        if (i == VM_DEFINE ? nargs != 2 : !lambda_ok(CDR(*args)))
+            return false;
+        *sym = CAR(*args);
+        emit_const(root, c, OP_CHECK_NEW, sym);
+        *expr = CDR(*args);
+        if (i == VM_DEFINE) {
+            *expr = CAR(*expr);
+            compile_expr(root, c, expr);
+        } else {
+            compile_lambda(root, c, expr);
+        }
+        emit_const(root, c, OP_DEFINE, sym);
+        return true;
+    case VM_LAMBDA:
+        if (!lambda_ok(*args))
+            return false;
+        compile_lambda(root, c, args);
+        return true;
+    case VM_WHILE:
+        if (nargs < 2)
+            return false;
+        compile_while(root, c, args);
+        return true;
+    case VM_PROGN:
+        if (nargs < 0)
+            return false;
+        c->tail = tail;
+        compile_seq(root, c, args);
+        return true;
+    case VM_LET:
+        return compile_let(root, c, args, tail);
+    case VM_COND:
+        if (!clauses_ok(*args))
+            return false;
+        compile_clauses(root, c, args, tail);
+        return true;
+    default:
+        if (nargs != (i < VM_CAR ? 2 : 1))
+            return false;
+        compile_args(root, c, args);
+        emit(root, c, OP_PRIM);
+        emit(root, c, i);
+        return true;
+    }
+}
+
+// Compiles a call to one of vm_prims, guarded by OP_GUARD. Returns false if the primitive is not
+// one of them, or the form is malformed.
+static bool compile_prim(void *root, Compiler *c, Obj **form, Obj *fn, bool tail) {
+    int i = 0;
+    while (i < VM_PRIMS && !is_vm_prim(fn, i))
+        i++;
+    if (i == VM_PRIMS)
+        return false;
+    DEFINE2(args, part);
+    *args = CDR(*form);
+    Obj **bytes = c->bytes;
+    int size = c->size;
+    *part = Nil;
+    c->bytes = part;
+    c->size = 0;
+    bool ok = compile_prim_args(root, c, i, args, tail);
+    int part_size = c->size;
+    c->bytes = bytes;
+    c->size = size;
+    if (!ok)
+        return false;
+    int k = constant(root, c, form);
+    emit(root, c, OP_GUARD);
+    emit(root, c, i);
+    emit(root, c, k);
+    emit16(root, c, part_size);
+    splice(c, part, part_size);
+    return true;
+}
+
+// (fn expr ...)
+static void compile_call(void *root, Compiler *c, Obj **form, bool tail) {
+    int nargs = length(CDR(*form));
+    if (nargs > UINT8_MAX) {
+        emit_const(root, c, OP_EVAL, form);
+        return;
+    }
+    DEFINE2(expr, args);
+    *expr = CAR(*form);
+    compile_expr(root, c, expr);
+    *expr = CDR(*form);
+    int args_size = compile_part(root, c, compile_args, args, expr);
+    int k = constant(root, c, form);
+    emit(root, c, OP_ENTER);
+    emit(root, c, k);
+    emit16(root, c, args_size + 2);
+    splice(c, args, args_size);
+    emit(root, c, tail ? OP_TAIL_CALL : OP_CALL);
+    emit(root, c, nargs);
+}
+
+// Returns true if the primitive evaluates all its arguments, in order.
+static bool evaluates_args(Obj *fn) {
+    return fn->flags & FLAG_BUILTIN;
+}
+
+static void compile_application(void *root, Compiler *c, Obj **form, bool tail) {
+    if (length(CDR(*form)) < 0) {
+        emit_const(root, c, OP_EVAL, form);
+        return;
+    }
+    DEFINE3(head, args, env);
+    *head = CAR(*form);
+    int depth, slot;
+    if (obj_type(*head) == TSYMBOL && !resolve(*c->scope, *head, &depth, &slot)) {
+        for (*env = *c->scope; obj_type(*env) == TCELL; *env = CDR(*env))
+            ;
+        *head = lookup(env, *head);
+        if (*head && obj_type(*head) == TMACRO) {
+            if ((*head)->flags & FLAG_UNCACHED) {
+                emit_const(root, c, OP_EVAL, form);
+            } else {
+                *args = CDR(*form);
+                *args = apply_func(root, env, head, args);
+                c->tail = tail;
+                compile_expr(root, c, args);
+            }
+            return;
+        }
+        if (*head && obj_type(*head) == TPRIMITIVE) {
+            if (compile_prim(root, c, form, *head, tail))
+                return;
+            if (!evaluates_args(*head)) {
+                emit_const(root, c, OP_EVAL, form);
+                return;
+            }
+        }
+    }
+    compile_call(root, c, form, tail);
 }
 
+static void compile_expr(void *root, Compiler *c, Obj **expr) {
+    bool tail = c->tail;
+    c->tail = false;
+    DEFINE1(obj);
+    *obj = *expr;
+    // The parts of a function body already analysed are compiled from what they stand for.
+    if (obj_type(*obj) == TNODE)
+        *obj = FORM(*obj);
+    if (obj_type(*obj) == TLOCAL)
+        *obj = VAR(*obj);
+    switch (obj_type(*obj)) {
+    case TINT:
+    case TPRIMITIVE:
+    case TFUNCTION:
+    case TVECTOR:
+    case TARRAY:
+    case TSTRING:
+    case TBYTES:
+    case TTABLE:
+    case TTRUE:
+    case TNIL:
+        compile_const(root, c, obj);
+        break;
+    case TSYMBOL:
+        compile_var(root, c, obj);
+        break;
+    case TCELL:
+        compile_application(root, c, obj, tail);
+        break;
+    default:
+        emit_const(root, c, OP_EVAL, obj);
+    }
+}
+
+// Compiles the expression to bytecode evaluating it in the given environment, see above. Returns
+// the expression itself if it does not fit the format.
+Obj *lisp_compile(void *root, Obj **env, Obj **expr) {
+    DEFINE2(bytes, consts);
+    *bytes = Nil;
+    *consts = Nil;
+    Compiler c = {bytes, 0, consts, 0, env, true, false};
+    compile_expr(root, &c, expr);
+    emit(root, &c, OP_RETURN);
+    Obj *code = assemble(root, &c);
+    return code ? code : *expr;
+}
+
+// The slots of the record of a call, see run_code()
+enum
+{
+    REC_CODE,
+    REC_ENV,
+    REC_PC,
+    REC_FP,
+    REC_SIZE,
+};
+
+static bool is_compiled(Obj *fn) {
+    Obj *body = BODY(fn);
+    return obj_type(body) == TCELL && obj_type(CAR(body)) == TCODE && CDR(body) == Nil;
+}
+
+// Returns the frame of a call to the function with the values in the given slots as arguments.
+static Obj *vm_frame(void *root, Obj **fn, void **args, int nargs) {
+    DEFINE3(frame, params, rest);
+    *frame = ENV(*fn);
+    *params = PARAMS(*fn);
+    *frame = make_frame(root, frame, params, count_params(*params));
+    int i = 0;
+    for (; obj_type(*params) == TCELL; *params = CDR(*params), i++) {
+        if (i == nargs)
+            error("Cannot apply function: number of argument does not match");
+        SET_SLOT(*frame, i, (Obj *)args[i]);
+    }
+    if (*params != Nil) {
+        *rest = list_of(root, nargs - i, (Obj **)args + i);
+        SET_SLOT(*frame, i, *rest);
+        write_barrier(*frame, *rest);
+    }
+    return *frame;
+}
+
+// Applies vm_prims[i] to the values in the given slots.
+static Obj *vm_prim(void *root, int i, Obj **args) {
+    static const char *const names[] = {"+", "-", "<", "<=", ">", ">="};
+    switch (i) {
+    case VM_CAR:
+    case VM_CDR:
+        if (obj_type(args[0]) != TCELL)
+            error(i == VM_CAR ? "Malformed car" : "Malformed cdr");
+        return i == VM_CAR ? CAR(args[0]) : CDR(args[0]);
+    case VM_NOT:
+        return logical_not(args[0]);
+    case VM_NUM_EQ:
+        return num_eq(args[0], args[1]);
+    case VM_EQ:
+        return args[0] == args[1] ? True : Nil;
+    case VM_CONS:
+        return cons(root, &args[0], &args[1]);
+    }
+    if (obj_type(args[0]) != TINT || obj_type(args[1]) != TINT)
+        error("%s takes only numbers", names[i - VM_PLUS]);
+    int a = int_value(args[0]), b = int_value(args[1]);
+    switch (i) {
+    case VM_PLUS:
+        return make_int(root, a + b);
+    case VM_MINUS:
+        return make_int(root, a - b);
+    case VM_LT:
+        return a < b ? True : Nil;
+    case VM_LTE:
+        return a <= b ? True : Nil;
+    case VM_GT:
+        return a > b ? True : Nil;
+    default:
+        return a >= b ? True : Nil;
+    }
+}
+
+#define PUSH(val)                             \
+    do {                                      \
+        Obj *val_ = (val);                    \
+        if (sp == limit)                      \
+            error("Root stack overflow");     \
+        *sp++ = val_;                         \
+    } while (0)
+
+#define OPERAND16(ip) ((ip)[0] | (ip)[1] << 8)
+
+// Runs the bytecode in the given environment. The slots from fp on hold the record of the running
+// call: its code and frame, the position to go on from in the code of the caller, and the offset of
+// the caller's record from base, or -1 for the call of run_code() itself. The operands follow.
+// The code and the frame are read from the record after anything that may run GC.
+static Obj *run_code(void *root, Obj **env, Obj **code) {
+    ADD_ROOT(REC_SIZE);
+    void **base = root_ADD_ROOT_, **fp = base, **sp = base + REC_SIZE;
+    void **limit = lisp_root_stack + LISP_ROOT_STACK_SIZE;
+    fp[REC_CODE] = *code;
+    fp[REC_ENV] = *env;
+    fp[REC_PC] = make_fixnum(0);
+    fp[REC_FP] = make_fixnum(-1);
+    int pc = 0;
+
+    for (;;) {
+        Obj *bc = fp[REC_CODE];
+        Obj **frame = (Obj **)&fp[REC_ENV];
+        uint8_t *ip = CODE_BYTES(bc) + pc;
+        switch (ip[0]) {
+        case OP_CONST:
+            pc += 2;
+            PUSH(CODE_CONST(bc, ip[1]));
+            break;
+        case OP_NIL:
+            pc += 1;
+            PUSH(Nil);
+            break;
+        case OP_TRUE:
+            pc += 1;
+            PUSH(True);
+            break;
+        case OP_LOCAL:
+        case OP_SET_LOCAL: {
+            pc += 3;
+            Obj *p = *frame;
+            for (int depth = ip[1]; depth > 0; depth--)
+                p = FRAME_REF(p->up);
+            if (ip[0] == OP_LOCAL) {
+                PUSH(SLOT(p, ip[2]));
+            } else {
+                SET_SLOT(p, ip[2], (Obj *)sp[-1]);
+                write_barrier(p, sp[-1]);
+            }
+            break;
+        }
+        case OP_LOOKUP: {
+            pc += 2;
+            Obj *sym = CODE_CONST(bc, ip[1]);
+            Obj *val = lookup(frame, sym);
+            if (!val)
+                error("Undefined symbol: %s", sym->name);
+            PUSH(val);
+            break;
+        }
+        case OP_POP:
+            pc += 1;
+            sp--;
+            break;
+        case OP_JUMP:
+            pc += 3 + OPERAND16(ip + 1);
+            break;
+        case OP_LOOP:
+            pc += 3 - OPERAND16(ip + 1);
+            break;
+        case OP_JUMP_NIL:
+            pc += 3 + (*--sp == Nil ? OPERAND16(ip + 1) : 0);
+            break;
+        case OP_ENTER: {
+            Obj *fn = sp[-1], *form = CODE_CONST(bc, ip[1]);
+            int type = obj_type(fn), head = obj_type(CAR(form));
+            if (type == TMACRO && (head == TSYMBOL || head == TLOCAL)) {
+                pc += 4 + OPERAND16(ip + 2);
+                sp[-1] = form;
+                sp[-1] = eval(sp, frame, (Obj **)&sp[-1]);
+            } else if (type == TPRIMITIVE && !evaluates_args(fn)) {
+                pc += 4 + OPERAND16(ip + 2);
+                Primitive *prim = fn->fn;
+                sp[-1] = CDR(form);
+                sp[-1] = prim(sp, frame, (Obj **)&sp[-1]);
+            } else if (type == TPRIMITIVE || type == TFUNCTION) {
+                pc += 4;
+            } else {
+                error("The head of a list must be a function");
+            }
+            break;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            int nargs = ip[1];
+            bool tail = ip[0] == OP_TAIL_CALL;
+            pc += 2;
+            void **args = sp - nargs;
+            Obj **fn = (Obj **)&args[-1];
+            if (obj_type(*fn) == TFUNCTION && is_compiled(*fn)) {
+                // The callee is run by this loop, from a new record in place of the function and
+                // its arguments, or of the running call if it's a tail call.
+                Obj *callee = vm_frame(sp, fn, args, nargs);
+                void **rec = tail ? fp : args - 1;
+                if (limit - rec < REC_SIZE)
+                    error("Root stack overflow");
+                rec[REC_CODE] = CAR(BODY(*fn));
+                rec[REC_ENV] = callee;
+                if (!tail) {
+                    rec[REC_PC] = make_fixnum(pc);
+                    rec[REC_FP] = make_fixnum(fp - base);
+                }
+                fp = rec;
+                sp = rec + REC_SIZE;
+                pc = 0;
+                break;
+            }
+            Obj *val;
+            if (obj_type(*fn) == TPRIMITIVE) {
+                // A builtin, as the others are called by OP_ENTER. It takes the arguments in place.
+                check_args((*fn)->builtin, nargs);
+                val = (*fn)->builtin->fn(sp, frame, nargs, (Obj **)args);
+            } else {
+                PUSH(list_of(sp, nargs, (Obj **)args));
+                val = apply_func(sp, frame, fn, (Obj **)&sp[-1]);
+            }
+            sp = args - 1;
+            *sp++ = val;
+            break;
+        }
+        case OP_GUARD: {
+            Obj *form = CODE_CONST(bc, ip[2]);
+            if (head_is_vm_prim(form, ip[1])) {
+                pc += 5;
+                break;
+            }
+            pc += 5 + OPERAND16(ip + 3);
+            PUSH(form);
+            sp[-1] = eval(sp, frame, (Obj **)&sp[-1]);
+            break;
+        }
+        case OP_PRIM: {
+            int i = ip[1], nargs = i < VM_CAR ? 2 : 1;
+            pc += 2;
+            Obj *val = vm_prim(sp, i, (Obj **)(sp - nargs));
+            sp -= nargs;
+            *sp++ = val;
+            break;
+        }
+        case OP_EVAL:
+            pc += 2;
+            PUSH(CODE_CONST(bc, ip[1]));
+            sp[-1] = eval(sp, frame, (Obj **)&sp[-1]);
+            break;
+        case OP_CLOSURE: {
+            pc += 2;
+            Obj *proto = CODE_CONST(bc, ip[1]);
+            PUSH(CAR(proto));
+            PUSH(CDR(proto));
+            Obj *fn = make_function(sp, frame, TFUNCTION, (Obj **)&sp[-2], (Obj **)&sp[-1]);
+            sp -= 2;
+            *sp++ = fn;
+            break;
+        }
+        case OP_CHECK_NEW: {
+            pc += 2;
+            Obj *sym = CODE_CONST(bc, ip[1]);
+            int slot;
+            if (find(frame, sym, &slot))
+                error("Already defined: %s", sym->name);
+            break;
+        }
+        case OP_DEFINE:
+            pc += 2;
+            PUSH(CODE_CONST(bc, ip[1]));
+            add_variable(sp, frame, (Obj **)&sp[-1], (Obj **)&sp[-2]);
+            sp--;
+            break;
+        case OP_WHILE:
+            pc += 1;
+            if (cycle_in_progress)
+                error("Nested loops are prohibited");
+            cycle_in_progress = true;
+            enter_loop();
+            PUSH(get_variable(sp, frame, "#itr"));
+            PUSH(make_fixnum(0));
+            set_int_binding(sp, (Obj **)&sp[-2], 0);
+            break;
+        case OP_NEXT: {
+            pc += 1;
+            int count = int_value(sp[-1]) + 1;
+            sp[-1] = make_fixnum(count);
+            set_int_binding(sp, (Obj **)&sp[-2], count);
+            next_iteration();
+            break;
+        }
+        case OP_DONE:
+            pc += 1;
+            cycle_in_progress = false;
+            leave_loop();
+            sp -= 2;
+            *sp++ = Nil;
+            break;
+        case OP_BIND: {
+            int n = ip[2];
+            pc += 3;
+            PUSH(CODE_CONST(bc, ip[1]));
+            Obj *env = make_frame(sp, frame, (Obj **)&sp[-1], n);
+            sp -= n + 1;
+            for (int i = 0; i < n; i++)
+                SET_SLOT(env, i, (Obj *)sp[i]);
+            *frame = env;
+            break;
+        }
+        case OP_UNBIND:
+            pc += 1;
+            *frame = FRAME_REF((*frame)->up);
+            break;
+        case OP_RETURN: {
+            Obj *val = sp[-1];
+            int caller = int_value(fp[REC_FP]);
+            if (caller < 0)
+                return val;
+            pc = int_value(fp[REC_PC]);
+            sp = fp;
+            fp = base + caller;
+            *sp++ = val;
+            break;
+        }
+        default:
+            error("Bug: run_code: unknown opcode %d", ip[0]);
+        }
+    }
+}
+
+#undef PUSH
+#undef OPERAND16
+
 //======================================================================
 // Entry point
 //======================================================================
 
-void lisp_create(size_t size)
+// Lays out the semi-spaces and the nursery in the given block, which must be at least
+// LISP_BUFFER_SIZE(size) bytes long.
+static void init_heap(void *block, size_t size)
+{
+    set_origin_ptr(literals);
+    heap_block = block;
+    MEMORY_SIZE = size & ~(sizeof(void *) - 1);
+    uint8_t *p = (uint8_t *)roundup((uintptr_t)block, sizeof(void *));
+#if LISP_COMPACT_REFS
+    // Move the constants to the beginning of the block, so that every object can be referred to by
+    // an offset from there.
+    lisp_heap_base = p;
+    memcpy(p, literals, sizeof(literals));
+    True = (Obj *)p;
+    Nil = True + 1;
+    Dot = True + 2;
+    Cparen = True + 3;
+    p += LISP_CONSTANTS_SIZE;
+#endif
+    sealed_space = p;
+    sealed_size = 0;
+    memory = p;
+    place_spaces();
+    min_memory_size = max_memory_size = MEMORY_SIZE;
+    Symbols = Nil;
+    Globals = Nil;
+    memset(symbol_table, 0, sizeof(symbol_table));
+    symbol_count = 0;
+    symbols_added = false;
+    memset(&stats, 0, sizeof(stats));
+}
+
+// Creates a heap of the given size. If the maximum size is larger, the heap grows and shrinks
+// between the two as needed, see resize_heap(). The compact references cannot follow the heap to
+// another block, so the heap keeps its size in that case.
+void lisp_create(size_t size, size_t max_size)
+{
+    if (memory == NULL)
+    {
+        void *block = malloc(LISP_BUFFER_SIZE(size));
+        if (block == NULL)
+            return;
+        init_heap(block, size);
+        heap_block_owned = true;
+#if !LISP_COMPACT_REFS
+        max_memory_size = max_size;
+#endif
+    }
+}
+
+void lisp_create_with_buffer(void *buffer, size_t size)
 {
     if (memory == NULL)
     {
-        set_origin_ptr(literals);
-        MEMORY_SIZE = size;
-        memory = alloc_semispace();
-        Symbols = Nil;
+        // Find the largest heap the buffer can take, see LISP_BUFFER_SIZE().
+#if LISP_MARK_COMPACT
+        // The tables take a few percent of the heap, so a couple of rounds are enough to get rid of
+        // the excess.
+        size_t heap_size = size;
+        while (heap_size > 0 && LISP_BUFFER_SIZE(heap_size) > size) {
+            size_t excess = LISP_BUFFER_SIZE(heap_size) - size;
+            heap_size = heap_size > excess ? heap_size - excess : 0;
+        }
+#else
+        size_t heap_size = (size - LISP_CONSTANTS_SIZE - 2 * sizeof(void *)) * GC_NURSERY_RATIO / (2 * GC_NURSERY_RATIO + 1);
+#endif
+        init_heap(buffer, heap_size);
+        heap_block_owned = false;
+    }
+}
+
+// Returns true if the function is in the heap and its body is yet to be analysed.
+static inline bool needs_analysis(Obj *obj) {
+    return obj->type == TFUNCTION && !(BODY(obj)->flags & FLAG_ANALYSED);
+}
+
+// Analyses the bodies of all the functions in the heap, which would otherwise be analysed in place
+// after being sealed, see rewrite_car(). The live objects are all in the heap after a collection,
+// and only the vector listing the functions is allocated before they have been listed.
+static void analyse_heap(void *root) {
+    gc(root);
+    int n = 0;
+    for (uint8_t *p = memory; p < (uint8_t *)memory + mem_nused; p += obj_size((Obj *)p))
+        n += needs_analysis((Obj *)p);
+    if (n == 0)
+        return;
+    DEFINE2(fns, fn);
+    *fns = make_vector(root, n, &Nil);
+    int i = 0;
+    for (uint8_t *p = memory; p < (uint8_t *)memory + mem_nused && i < n; p += obj_size((Obj *)p))
+        if (needs_analysis((Obj *)p))
+            SET_ELEM(*fns, i++, (Obj *)p);
+    for (i = 0; i < n; i++) {
+        *fn = ELEM(*fns, i);
+        if (*fn != Nil && !(BODY(*fn)->flags & FLAG_ANALYSED))
+            analyse_body(root, fn);
     }
 }
 
+// Moves everything reachable to the sealed region. The two semi-spaces are carved from the rest of
+// the space they used to take, so the sealed objects no longer need room in both of them. The
+// function bodies are analysed first, so that the code is sealed as it runs from then on.
+void lisp_seal(void *root)
+{
+    analyse_heap(root);
+
+    // Collect twice if needed, so that the live objects end up right after the sealed region.
+    gc(root);
+    if (memory != sealed_space + sealed_size)
+        gc(root);
+
+    sealed_size += mem_nused;
+    memory = sealed_space + sealed_size;
+#if LISP_MARK_COMPACT
+    // The heap simply ends where it used to, right before the nursery.
+    MEMORY_SIZE -= mem_nused;
+#else
+    size_t free_size = 2 * MEMORY_SIZE - mem_nused;
+    MEMORY_SIZE = (free_size / 2) & ~(sizeof(void *) - 1);
+    spare_space = (uint8_t *)memory + MEMORY_SIZE;
+#endif
+    mem_nused = 0;
+    if (debug_gc)
+        printf_to_handler(NULL, 0, "GC: %zu bytes sealed.\n", sealed_size);
+}
+
 void lisp_destroy(void)
 {
     if (memory != NULL)
     {
-        free(memory);
+        if (heap_block_owned)
+            free(heap_block);
+        heap_block = NULL;
+        heap_block_owned = false;
         memory = NULL;
         from_space = NULL;
+        spare_space = NULL;
+        nursery = NULL;
+#if LISP_MARK_COMPACT
+        mark_bits = NULL;
+        forwarding = NULL;
+        mark_top = 0;
+        mark_overflow = false;
+#endif
         gc_running = false;
+        major_gc_running = false;
+#if LISP_INCREMENTAL_GC
+        incremental_gc_running = false;
+#endif
         mem_nused = 0;
+        nursery_nused = 0;
+        remembered_count = 0;
+        remembered_overflow = false;
+        sealed_overflow = false;
+        sealed_space = NULL;
+        sealed_size = 0;
+#if LISP_COMPACT_REFS
+        lisp_heap_base = NULL;
+        True = &literals[0];
+        Nil = &literals[1];
+        Dot = &literals[2];
+        Cparen = &literals[3];
+#endif
         current_index = 0;
     }
 }
@@ -1255,6 +5092,7 @@ bool lisp_eval(void *root, Obj **env, const char *code)
 {
     current_buffer = code;
     current_index = 0;
+    stats.high_water = lisp_mem_used();
 
     DEFINE1(expr);
     while (true)
@@ -1268,10 +5106,12 @@ bool lisp_eval(void *root, Obj **env, const char *code)
                 error("Stray close parenthesis");
             if (*expr == Dot)
                 error("Stray dot");
+            if (compile_forms)
+                *expr = lisp_compile(root, env, expr);
 
             char buf[SYMBOL_MAX_LEN];
             print_to_buf(buf, 0, eval(root, env, expr));
-            printf_to_handler(NULL, 0, buf);
+            printf_to_handler(NULL, 0, "%s", buf);
         }
         else
             return false;
@@ -1280,11 +5120,14 @@ bool lisp_eval(void *root, Obj **env, const char *code)
 
 bool safe_eval(void *root, Obj **env, Obj **expr)
 {
+    stats.high_water = lisp_mem_used();
     if (setjmp(error_jumper) == 0)
     {
+        DEFINE1(code);
+        *code = compile_forms ? lisp_compile(root, env, expr) : *expr;
         char buf[SYMBOL_MAX_LEN];
-        print_to_buf(buf, 0, eval(root, env, expr));
-        printf_to_handler(NULL, 0, buf);
+        print_to_buf(buf, 0, eval(root, env, code));
+        printf_to_handler(NULL, 0, "%s", buf);
         return true;
     }
     return false;
@@ -1303,7 +5146,48 @@ void lisp_set_printers(print_def out, print_def log, print_def err)
 }
 
 size_t lisp_mem_used(void) {
-    return mem_nused;
+    return sealed_size + mem_nused + nursery_nused;
+}
+
+GcStats lisp_gc_stats(void)
+{
+    return stats;
+}
+
+void lisp_set_timer(timer_def time_us)
+{
+    timer = time_us;
+}
+
+// Sets the longest time in microseconds a step of a major collection should take. Zero, the
+// default, makes every major collection stop the interpreter until it is over. It has no effect
+// unless LISP_INCREMENTAL_GC is set.
+void lisp_set_gc_budget(unsigned long budget)
+{
+#if LISP_INCREMENTAL_GC
+    gc_pause_budget = budget;
+#endif
+}
+
+// Makes lisp_eval() and safe_eval() compile every expression to bytecode before evaluating it.
+void lisp_set_compile(bool enabled)
+{
+    compile_forms = enabled;
+}
+
+// Does the work of a running incremental collection for up to the pause budget. It is called on
+// every iteration of a loop, and can be called by the host whenever it is idle.
+void lisp_gc_step(void)
+{
+#if LISP_INCREMENTAL_GC
+    if (!incremental_gc_running || gc_running)
+        return;
+    unsigned long start = time_us();
+    do
+        incremental_scan(GC_STEP_SIZE);
+    while (incremental_gc_running && time_us() - start < gc_pause_budget);
+    record_pause(start);
+#endif
 }
 
 int lisp_error_idx(void)
@@ -1312,47 +5196,48 @@ int lisp_error_idx(void)
 }
 
 // Used to simplify the work with the emulator. This has no other practical use!
+// Builds the body of a pruner, i.e. ((handler 'name param ...)) or ((handler param ...)).
+static Obj *make_pruner_body(void *root, Obj **sym, Obj **params, const char *handler_name, bool include_name)
+{
+    DEFINE3(body, tmp, lp);
+    *tmp = intern(root, handler_name);
+    *body = cons(root, tmp, &Nil);
+    if (include_name)
+    {
+        *tmp = cons(root, sym, &Nil);
+        *lp = intern(root, "quote");
+        *tmp = cons(root, lp, tmp);
+        *body = cons(root, tmp, body);
+    }
+    for (*lp = *params; obj_type(*lp) == TCELL; *lp = CDR(*lp))
+    {
+        *tmp = CAR(*lp);
+        *body = cons(root, tmp, body);
+    }
+    *body = reverse(*body);
+    return cons(root, body, &Nil);
+}
+
 Obj *handle_pruner(void *root, Obj **env, Obj **list, const char *handler_name, bool include_name)
 {
-    if ((*list)->car->type != TSYMBOL || (*list)->cdr->type != TCELL || !is_list((*list)->cdr->car))
+    if (obj_type(CAR(*list)) != TSYMBOL || obj_type(CDR(*list)) != TCELL || !is_list(CAR(CDR(*list))))
         error("Malformed pruner");
-    DEFINE4(fn, sym, rest, bind);
-    *sym = (*list)->car;
-    *rest = (*list)->cdr;
-    *bind = find(env, *sym);
-    if (*bind)
+    DEFINE4(fn, sym, params, body);
+    *sym = CAR(*list);
+    *params = CAR(CDR(*list));
+    int slot;
+    if (find(env, *sym, &slot))
         error("Already defined: %s", (*sym)->name);
 
-    Obj *p = (*rest)->car;
-    for (; p->type == TCELL; p = p->cdr)
-        if (p->car->type != TSYMBOL)
+    Obj *p = *params;
+    for (; obj_type(p) == TCELL; p = CDR(p))
+        if (obj_type(CAR(p)) != TSYMBOL)
             error("Parameter must be a symbol");
-    if (p != Nil && p->type != TSYMBOL)
+    if (p != Nil && obj_type(p) != TSYMBOL)
         error("Parameter must be a symbol");
 
-    {
-        DEFINE3(handler, params, body);
-        *handler = intern(root, handler_name);
-        *params = (*rest)->car;
-        *body = Nil;
-        *body = cons(root, handler, body);
-        if (include_name)
-        {
-            DEFINE2(tmp, quote);
-            *tmp = *sym;
-            *quote = intern(root, "quote");
-            *tmp = cons(root, tmp, &Nil);
-            *tmp = cons(root, quote, tmp);
-            *body = cons(root, tmp, body);
-        }
-        Obj *s = (*rest)->car;
-        for (; s->type == TCELL; s = s->cdr)
-            *body = cons(root, &s->car, body);
-        *body = reverse(*body);
-        *body = cons(root, body, &Nil);
-
-        *fn = make_function(root, env, TFUNCTION, params, body);
-    }
+    *body = make_pruner_body(root, sym, params, handler_name, include_name);
+    *fn = make_function(root, env, TFUNCTION, params, body);
     add_variable(root, env, sym, fn);
     return *fn;
 }
@@ -31,40 +31,151 @@ extern "C" {
 
 #define MAX_LOOP_ITERATIONS 9999
 
-#define ROOT_END ((void *)-1)
-
-#define ADD_ROOT(size)                   \
-    void *root_ADD_ROOT_[size + 2];      \
-    root_ADD_ROOT_[0] = root;            \
-    for (int i = 1; i <= size; i++)      \
-        root_ADD_ROOT_[i] = NULL;        \
-    root_ADD_ROOT_[size + 1] = ROOT_END; \
-    root = root_ADD_ROOT_
+// The nursery takes 1/GC_NURSERY_RATIO of the heap size on top of the heap
+#define GC_NURSERY_RATIO 8
+
+// Objects larger than 1/GC_PRETENURE_RATIO of the nursery are allocated in the old generation
+#define GC_PRETENURE_RATIO 4
+
+// The maximum number of old objects pointing to the nursery a minor collection can keep track of.
+// When it overflows, the next collection is a major one.
+#define REMEMBERED_SET_SIZE 64
+
+// The number of slots of the symbol table used by intern(). It must be a power of 2. Once the table
+// is 3/4 full, the symbols that do not fit are kept in a list that is searched linearly.
+#ifndef LISP_SYMBOL_TABLE_SIZE
+#if ESP8266
+#define LISP_SYMBOL_TABLE_SIZE 256
+#else
+#define LISP_SYMBOL_TABLE_SIZE 1024
+#endif
+#endif
+
+// If set to 1, objects refer to each other by 32-bit offsets from the beginning of the heap instead
+// of pointers, and the fixed-size objects do not store their size. This roughly halves the size of
+// the objects on 64-bit hosts, e.g. a cons cell takes 12 bytes instead of 24. The heap is limited to
+// 4 GB then, and every access to a field of an object costs an addition.
+#ifndef LISP_COMPACT_REFS
+#define LISP_COMPACT_REFS 0
+#endif
+
+// If set to 1, a major collection can be spread over many short steps instead of stopping the
+// interpreter until it is over, see lisp_set_gc_budget(). Every read of a field of an object goes
+// through a read barrier then, which makes the interpreter somewhat slower.
+#ifndef LISP_INCREMENTAL_GC
+#define LISP_INCREMENTAL_GC 0
+#endif
+
+// If set to 1, a major collection compacts the live objects in place (sliding mark-compact) instead
+// of copying them to the other semi-space. The heap then needs no second semi-space, only a mark
+// bitmap and a forwarding table of about 1/20 of its size, at the cost of slower major collections.
+// It cannot be combined with LISP_INCREMENTAL_GC.
+#ifndef LISP_MARK_COMPACT
+#define LISP_MARK_COMPACT 0
+#endif
+
+#if LISP_MARK_COMPACT && LISP_INCREMENTAL_GC
+#error "LISP_MARK_COMPACT and LISP_INCREMENTAL_GC cannot be combined"
+#endif
+
+// The number of objects the marking phase of a mark-compact collection can keep track of at once.
+// When it overflows, the heap is scanned again for the objects left behind.
+#define GC_MARK_STACK_SIZE 64
+
+// The number of bytes an incremental collection scans for every byte allocated while it runs. The
+// larger the ratio, the sooner the collection is over and the longer the allocations take.
+#define GC_INCREMENT_RATIO 4
+
+// The number of bytes lisp_gc_step() scans between two checks of the time
+#define GC_STEP_SIZE 256
+
+// The compact layout keeps the constants (see True, Nil, etc.) at the beginning of the heap, so that
+// they can be referred to by offsets as well.
+#if LISP_COMPACT_REFS
+#define LISP_CONSTANTS_SIZE (4 * sizeof(struct Obj))
+#else
+#define LISP_CONSTANTS_SIZE 0
+#endif
+
+// A growable heap (see lisp_create()) doubles in size when more than GC_GROW_PERCENT of it survives
+// a major collection, and halves when less than GC_SHRINK_PERCENT does.
+#define GC_GROW_PERCENT 50
+#define GC_SHRINK_PERCENT 10
+
+// The number of bytes lisp_create() reserves for a heap of the given size: two semi-spaces (or one
+// and the mark-compact tables), the nursery, the constants and the alignment slack. A buffer of
+// this size can be passed to lisp_create_with_buffer().
+#if LISP_MARK_COMPACT
+#define LISP_BUFFER_SIZE(heap_size)                                                            \
+    ((heap_size) + (heap_size) / GC_NURSERY_RATIO + LISP_CONSTANTS_SIZE + 3 * sizeof(void *) + \
+     GC_MARK_TABLE_SIZE((heap_size) + (heap_size) / GC_NURSERY_RATIO))
+#else
+#define LISP_BUFFER_SIZE(heap_size) \
+    (2 * (heap_size) + (heap_size) / GC_NURSERY_RATIO + LISP_CONSTANTS_SIZE + 2 * sizeof(void *))
+#endif
+
+// The size of the mark bitmap and the forwarding table for a mark-compact heap of the given size.
+// There is a bit per reference-sized word of the heap, and a table entry per 32 such bits.
+#define GC_MARK_TABLE_SIZE(size) \
+    (((size) / (32 * sizeof(Ref)) + 2) * (sizeof(uint32_t) + sizeof(size_t)))
+
+// The number of pointers the root stack can hold, see ADD_ROOT(). Every level of a Lisp function call
+// takes a couple dozen of them, about as deep as the C stack of the target lets the calls go.
+#ifndef LISP_ROOT_STACK_SIZE
+#if ESP8266
+#define LISP_ROOT_STACK_SIZE 512
+#elif ESP32
+#define LISP_ROOT_STACK_SIZE 1024
+#else
+#define LISP_ROOT_STACK_SIZE 16384
+#endif
+#endif
+
+// The GC roots held by C code live in a single stack of pointers. The root argument passed from
+// function to function points to the first free slot of it. ADD_ROOT() reserves the slots by moving
+// the function's own copy of root past them, and returning from the function is all it takes to
+// release them. A collection scans the stack from the bottom up to the root it has been given.
+//
+// If root is NULL or points to a frame built by hand outside of the stack, the slots are reserved
+// at the bottom of the stack, see lisp_enter_roots().
+#define ADD_ROOT(size)                                                           \
+    void **root_ADD_ROOT_ = (void **)root;                                       \
+    if ((size_t)((char *)root_ADD_ROOT_ - (char *)lisp_root_stack) >             \
+        sizeof(lisp_root_stack) - (size) * sizeof(void *))                       \
+        root_ADD_ROOT_ = lisp_enter_roots(root);                                 \
+    for (int i = 0; i < size; i++)                                               \
+        root_ADD_ROOT_[i] = NULL;                                                \
+    root = root_ADD_ROOT_ + (size)
 
 #define DEFINE1(var1) \
     ADD_ROOT(1);      \
-    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1)
+    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 0)
 
 #define DEFINE2(var1, var2)                    \
     ADD_ROOT(2);                               \
-    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1); \
-    Obj **var2 = (Obj **)(root_ADD_ROOT_ + 2)
+    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 0); \
+    Obj **var2 = (Obj **)(root_ADD_ROOT_ + 1)
 
 #define DEFINE3(var1, var2, var3)              \
     ADD_ROOT(3);                               \
-    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1); \
-    Obj **var2 = (Obj **)(root_ADD_ROOT_ + 2); \
-    Obj **var3 = (Obj **)(root_ADD_ROOT_ + 3)
+    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 0); \
+    Obj **var2 = (Obj **)(root_ADD_ROOT_ + 1); \
+    Obj **var3 = (Obj **)(root_ADD_ROOT_ + 2)
 
 #define DEFINE4(var1, var2, var3, var4)        \
     ADD_ROOT(4);                               \
-    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1); \
-    Obj **var2 = (Obj **)(root_ADD_ROOT_ + 2); \
-    Obj **var3 = (Obj **)(root_ADD_ROOT_ + 3); \
-    Obj **var4 = (Obj **)(root_ADD_ROOT_ + 4)
+    Obj **var1 = (Obj **)(root_ADD_ROOT_ + 0); \
+    Obj **var2 = (Obj **)(root_ADD_ROOT_ + 1); \
+    Obj **var3 = (Obj **)(root_ADD_ROOT_ + 2); \
+    Obj **var4 = (Obj **)(root_ADD_ROOT_ + 3)
+
+// A frame built by hand is an array of pointers. The first one points to the previous frame, the
+// roots follow, and ROOT_END terminates them. It must not look like a fixnum, see is_fixnum().
+#define ROOT_END ((void *)-2)
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -72,6 +183,7 @@ extern "C" {
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 //======================================================================
 // Lisp objects
@@ -88,6 +200,19 @@ enum
     TFUNCTION,
     TMACRO,
     TENV,
+    TVECTOR,
+    TARRAY,
+    TSTRING,
+    TBYTES,
+    TTABLE,
+    // A reference to a parameter of a function, see analyse_body(). It replaces the symbol in the
+    // body of the function, and evaluates to the value of the parameter.
+    TLOCAL,
+    // A compiled form, see compile_form(). It replaces the form in the body of a function.
+    TNODE,
+    // Bytecode, see lisp_compile(). It evaluates to the value of the expression it was compiled
+    // from, and is the only form of the body of a compiled function.
+    TCODE,
     // The marker that indicates the object has been moved to other location by GC. The new location
     // can be found at the forwarding pointer. Only the functions to do garbage collection set and
     // handle the object of this type. Other functions will never see the object of this type.
@@ -99,10 +224,55 @@ enum
     TCPAREN,
 };
 
+// Object flags
+enum
+{
+    // The object is in the remembered set
+    FLAG_REMEMBERED = 1,
+    // The first cell of a function body that has been analysed, see analyse_body()
+    FLAG_ANALYSED = 2,
+    // The first cell of a function body that has been evaluated before
+    FLAG_CALLED = 4,
+    // A primitive taking expressions evaluated in the caller's environment as arguments
+    FLAG_EXPR_ARGS = 8,
+    // A symbol that has been bound outside the global environment, as a parameter or by define
+    FLAG_LOCAL_NAME = 16,
+    // A macro whose calls are expanded every time, see defmacro-uncached
+    FLAG_UNCACHED = 32,
+    // A primitive defined by a Builtin, see add_builtin()
+    FLAG_BUILTIN = 64,
+    // A table holding keys hashed by their address, see key_hash()
+    FLAG_ADDRESS_KEYS = 128,
+};
+
 // Typedef for the primitive function
 struct Obj;
 typedef struct Obj *Primitive(void *root, struct Obj **env, struct Obj **args);
 
+// Typedef for the function of a builtin. It gets the values of the arguments, argc of them from
+// argv on, in slots of the root stack below root.
+typedef struct Obj *BuiltinFn(void *root, struct Obj **env, int argc, struct Obj **argv);
+
+// A primitive taking its arguments evaluated. The number of arguments is checked against min_args
+// and max_args before the function is called; max_args is -1 if there is no limit.
+typedef struct
+{
+    const char *name;
+    BuiltinFn *fn;
+    int min_args;
+    int max_args;
+} Builtin;
+
+// A reference from one object to another. Use the accessors below (CAR(), SET_CAR(), etc.) to read
+// and write the fields of this type.
+#if LISP_COMPACT_REFS
+typedef uint32_t Ref;
+#define LISP_PACKED __attribute__((packed))
+#else
+typedef struct Obj *Ref;
+#define LISP_PACKED
+#endif
+
 // The object type
 typedef struct Obj
 {
@@ -113,9 +283,14 @@ typedef struct Obj
     // It indicates if object is a constant value.
     unsigned char constant;
 
+    // Flags used by GC.
+    unsigned char flags;
+
+#if !LISP_COMPACT_REFS
     // The total size of the object, including "type" field, this field, the contents, and the
-    // padding at the end of the object.
+    // padding at the end of the object. The compact layout works it out from the type instead.
     int size;
+#endif
 
     // Object values.
     union {
@@ -124,34 +299,218 @@ typedef struct Obj
         // Cell
         struct
         {
-            struct Obj *car;
-            struct Obj *cdr;
+            Ref car;
+            Ref cdr;
         };
-        // Symbol
-        char name[1];
-        // Primitive
-        Primitive *fn;
+        // Symbol. The hash of the name is computed once, see intern(). The global binding, if any,
+        // is the (symbol . value) cell of the global environment, Nil otherwise.
+        struct
+        {
+            Ref global;
+            uint32_t hash;
+            char name[1];
+        };
+        // Primitive. It must not make the compact objects pointer-aligned.
+        Primitive *fn LISP_PACKED;
+        // Primitive flagged FLAG_BUILTIN
+        const Builtin *builtin LISP_PACKED;
         // Function or Macro
         struct
         {
-            struct Obj *params;
-            struct Obj *body;
-            struct Obj *env;
+            Ref params;
+            Ref body;
+            Ref env;
+        };
+        // Environment frame. The values of the parameters of a function call are stored in the
+        // slots, in the order of the parameter list, which is kept in names. The variables added by
+        // define are kept in the association list vars. The frames are linked to their parents by
+        // up, the last one is the global environment.
+        struct
+        {
+            Ref vars;
+            Ref up;
+            Ref names;
+            int nslots;
+            Ref slots[1];
         };
-        // Environment frame. This is a linked list of association lists
-        // containing the mapping from symbols to their value.
+        // Vector, or array of integers. The elements are stored in place, nelems of them.
         struct
         {
-            struct Obj *vars;
-            struct Obj *up;
+            int nelems;
+            union {
+                Ref elems[1];
+                int32_t ints[1];
+            };
+        };
+        // String or byte buffer, len bytes from offset start of the bytes of base. An object made
+        // by a literal or a copy stores its bytes in place and has Nil as base. A slice stores
+        // none, base is the object holding the bytes, so that slicing never copies.
+        struct
+        {
+            Ref base;
+            int start;
+            int len;
+            char bytes[1];
+        };
+        // Hash table. The entries are pairs of elements of the vector entries, a key followed by its
+        // value. nused counts the entries and the deleted ones left in their place. The keys hashed
+        // by address are rehashed once a collection has moved the objects since epoch.
+        struct
+        {
+            Ref entries;
+            int nentries;
+            int nused;
+            uint32_t epoch;
+        };
+        // Local variable reference. The parameter var of the function whose parameter list is
+        // binder, found in the given slot of the frame depth levels up.
+        struct
+        {
+            Ref var;
+            Ref binder;
+            uint16_t depth;
+            uint16_t slot;
+        };
+        // Compiled form. The handler evaluates the form, given the node as its last argument.
+        struct
+        {
+            Ref form;
+            Primitive *handler LISP_PACKED;
+        };
+        // Bytecode. The instructions follow the constants they refer to, see CODE_BYTES().
+        struct
+        {
+            uint16_t nconsts;
+            uint16_t nbytes;
+            Ref consts[1];
         };
         // Forwarding pointer
-        void *moved;
+        Ref moved;
     };
 } Obj;
 
+// Integers in the fixnum range are immediate values. Instead of pointing to a heap object, such a
+// pointer holds the value shifted left by one bit, with the lowest bit set. Objects are aligned, so
+// their addresses never have that bit set. Other integers are boxed in a TINT object. The range is
+// 31 bits wide on any host, so that a fixnum always fits in 32 bits.
+#define FIXNUM_MIN (-(1 << 30))
+#define FIXNUM_MAX ((1 << 30) - 1)
+
+static inline bool is_fixnum(Obj *obj)
+{
+    return (uintptr_t)obj & 1;
+}
+
+static inline Obj *make_fixnum(int value)
+{
+    return (Obj *)(((uintptr_t)(intptr_t)value << 1) | 1);
+}
+
+// Returns the type of any object, immediate or not.
+static inline int obj_type(Obj *obj)
+{
+    return is_fixnum(obj) ? (int)TINT : obj->type;
+}
+
+// Returns the value of an integer, immediate or boxed.
+static inline int int_value(Obj *obj)
+{
+    return is_fixnum(obj) ? (int)((intptr_t)obj >> 1) : obj->value;
+}
+
+// The compact references are offsets from lisp_heap_base. Fixnums are stored as they are, their
+// 31 bits fit and their lowest bit tells them apart from the offsets, which are always even.
+#if LISP_COMPACT_REFS
+extern uint8_t *lisp_heap_base;
+
+static inline Obj *ref_to_obj(Ref ref)
+{
+    return (ref & 1) ? (Obj *)(intptr_t)(int32_t)ref : (Obj *)(lisp_heap_base + ref);
+}
+
+static inline Ref obj_to_ref(Obj *obj)
+{
+    return is_fixnum(obj) ? (Ref)(uintptr_t)obj : (Ref)((uint8_t *)obj - lisp_heap_base);
+}
+
+// Same as ref_to_obj(), for the references that are known not to hold a fixnum.
+static inline Obj *ref_to_ptr(Ref ref)
+{
+    return (Obj *)(lisp_heap_base + ref);
+}
+#else
+#define ref_to_obj(ref) (ref)
+#define obj_to_ref(obj) (obj)
+#define ref_to_ptr(ref) (ref)
+#endif
+
+// Accessors for the fields holding references. The reads go through read_barrier(), see below.
+#define CAR(obj) read_barrier(ref_to_obj((obj)->car))
+#define CDR(obj) read_barrier(ref_to_obj((obj)->cdr))
+#define PARAMS(obj) read_barrier(ref_to_obj((obj)->params))
+#define BODY(obj) read_barrier(ref_to_obj((obj)->body))
+#define ENV(obj) read_barrier(ref_to_obj((obj)->env))
+#define VARS(obj) read_barrier(ref_to_obj((obj)->vars))
+#define UP(obj) read_barrier(ref_to_obj((obj)->up))
+#define GLOBAL(obj) read_barrier(ref_to_obj((obj)->global))
+#define NAMES(obj) read_barrier(ref_to_obj((obj)->names))
+#define SLOT(obj, i) read_barrier(ref_to_obj((obj)->slots[i]))
+#define ELEM(obj, i) read_barrier(ref_to_obj((obj)->elems[i]))
+#define BASE(obj) read_barrier(ref_to_obj((obj)->base))
+#define ENTRIES(obj) read_barrier(ref_to_obj((obj)->entries))
+#define VAR(obj) read_barrier(ref_to_obj((obj)->var))
+#define BINDER(obj) read_barrier(ref_to_obj((obj)->binder))
+#define FORM(obj) read_barrier(ref_to_obj((obj)->form))
+#define CODE_CONST(obj, i) read_barrier(ref_to_obj((obj)->consts[i]))
+#define MOVED(obj) ref_to_obj((obj)->moved)
+#define CODE_BYTES(obj) ((uint8_t *)((obj)->consts + (obj)->nconsts))
+
+#define SET_CAR(obj, val) ((obj)->car = obj_to_ref(val))
+#define SET_CDR(obj, val) ((obj)->cdr = obj_to_ref(val))
+#define SET_PARAMS(obj, val) ((obj)->params = obj_to_ref(val))
+#define SET_BODY(obj, val) ((obj)->body = obj_to_ref(val))
+#define SET_ENV(obj, val) ((obj)->env = obj_to_ref(val))
+#define SET_VARS(obj, val) ((obj)->vars = obj_to_ref(val))
+#define SET_UP(obj, val) ((obj)->up = obj_to_ref(val))
+#define SET_GLOBAL(obj, val) ((obj)->global = obj_to_ref(val))
+#define SET_NAMES(obj, val) ((obj)->names = obj_to_ref(val))
+#define SET_SLOT(obj, i, val) ((obj)->slots[i] = obj_to_ref(val))
+#define SET_ELEM(obj, i, val) ((obj)->elems[i] = obj_to_ref(val))
+#define SET_BASE(obj, val) ((obj)->base = obj_to_ref(val))
+#define SET_ENTRIES(obj, val) ((obj)->entries = obj_to_ref(val))
+#define SET_VAR(obj, val) ((obj)->var = obj_to_ref(val))
+#define SET_BINDER(obj, val) ((obj)->binder = obj_to_ref(val))
+#define SET_FORM(obj, val) ((obj)->form = obj_to_ref(val))
+#define SET_CODE_CONST(obj, i, val) ((obj)->consts[i] = obj_to_ref(val))
+#define SET_MOVED(obj, val) ((obj)->moved = obj_to_ref(val))
+
 typedef void (*yield_def)();
 typedef void (*print_def)(const char *msg, int size);
+typedef unsigned long (*timer_def)(void);
+
+// GC and allocator statistics, see lisp_gc_stats()
+typedef struct GcStats
+{
+    // The number of collections run
+    size_t minor_collections;
+    size_t major_collections;
+
+    // The pause times of the collections in microseconds, see lisp_set_timer()
+    unsigned long total_pause;
+    unsigned long max_pause;
+
+    // The number of bytes copied by the collections
+    size_t bytes_copied;
+
+    // The number of bytes allocated, indexed by the object type. Fixnums take none.
+    size_t bytes_allocated[TMOVED];
+
+    // The highest lisp_mem_used() since the start of the last lisp_eval() or safe_eval()
+    size_t high_water;
+
+    // The number of bytes used right after the last major collection, i.e. the size of the live set
+    size_t live_after_gc;
+} GcStats;
 
 // Constants
 extern Obj *True;
@@ -167,18 +526,59 @@ extern bool always_gc;
 // The size of the heap in byte
 extern size_t MEMORY_SIZE;
 
+// The root stack, see ADD_ROOT(). The first slot links the frames built by hand, if any.
+extern void *lisp_root_stack[LISP_ROOT_STACK_SIZE];
+
+// Returns the first slot of the root stack for a root that is not on it yet. The given root is
+// kept as the link to the frames built by hand. Reports an error if the stack is full instead.
+void **lisp_enter_roots(void *root);
+
+#if LISP_INCREMENTAL_GC
+// True while an incremental collection is in progress
+extern bool incremental_gc_running;
+
+// The semi-space that is not in use. While an incremental collection runs, it is the from-space.
+extern void *spare_space;
+
+Obj *gc_read_barrier(Obj *obj);
+
+// Makes sure the interpreter never sees an object in the from-space of an incremental collection.
+// Such an object is copied to the to-space on the first read of a reference to it.
+static inline Obj *read_barrier(Obj *obj)
+{
+    if (incremental_gc_running && !is_fixnum(obj) && (size_t)((uint8_t *)obj - (uint8_t *)spare_space) < MEMORY_SIZE)
+        return gc_read_barrier(obj);
+    return obj;
+}
+#else
+#define read_barrier(obj) (obj)
+#endif
+
 void gc(void *root);
 
+void write_barrier(Obj *obj, Obj *val);
+
 Obj *read_expr(void *root);
 
 Obj *eval(void *root, Obj **env, Obj **obj);
 
 Obj *eval_list(void *root, Obj **env, Obj **list);
 
+Obj *lisp_compile(void *root, Obj **env, Obj **expr);
+
 Obj *make_int(void *root, int value);
 
 Obj *make_symbol(void *root, const char *name);
 
+// Returns a new string or byte buffer holding a copy of the len bytes at data.
+Obj *make_string(void *root, const char *data, int len);
+
+Obj *make_bytes(void *root, const uint8_t *data, int len);
+
+// Returns the bytes of a string or a byte buffer, obj->len of them. They are not NUL-terminated and
+// are only valid until the next allocation.
+const char *string_bytes(Obj *obj);
+
 struct Obj *make_env(void *root, Obj **vars, Obj **up);
 
 int length(Obj *list);
@@ -195,13 +595,20 @@ void print(Obj *obj);
 
 void add_primitive(void *root, Obj **env, const char *name, Primitive *fn);
 
+// The builtin is kept by reference, so it must outlive the interpreter.
+void add_builtin(void *root, Obj **env, const Builtin *builtin);
+
 void add_constant(void *root, Obj **env, const char *name, Obj **val);
 
 void add_constant_int(void *root, Obj **env, const char *name, int value);
 
 Obj *get_variable(void *root, Obj **env, const char *name);
 
-void lisp_create(size_t size);
+void lisp_create(size_t size, size_t max_size);
+
+void lisp_create_with_buffer(void *buffer, size_t size);
+
+void lisp_seal(void *root);
 
 void lisp_destroy(void);
 
@@ -217,6 +624,16 @@ void lisp_set_printers(print_def out, print_def log, print_def err);
 
 size_t lisp_mem_used(void);
 
+GcStats lisp_gc_stats(void);
+
+void lisp_set_timer(timer_def timer);
+
+void lisp_set_gc_budget(unsigned long budget);
+
+void lisp_gc_step(void);
+
+void lisp_set_compile(bool enabled);
+
 int lisp_error_idx(void);
 
 Obj *handle_pruner(void *root, Obj **env, Obj **list, const char *handler_name, bool include_name);
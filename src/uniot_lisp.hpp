@@ -0,0 +1,231 @@
+/*
+ * This is a part of the Uniot project. The following is the user apps interpreter.
+ * Copyright (C) 2019-2020 Uniot <contact@uniot.io>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// C++ bindings. bind() adds a builtin calling a lambda without captures, whose signature tells how
+// many arguments the builtin takes and what they are converted to:
+//
+//     uniot_lisp::bind(root, env, "pwm", [](int pin, int duty) { analogWrite(pin, duty); });
+//
+// The function converting the arguments and the result is generated for the lambda at compile
+// time, so a call conses no argument list and does no check but those of the parameter types.
+//
+// A parameter is one of:
+// - int, taking an integer;
+// - bool, taking any value, true unless it's ();
+// - const char *, taking a symbol, the name of which it points to;
+// - Obj *, taking any value;
+// - Obj **, pointing to the slot of the root stack holding the value;
+// - Context, as the first parameter only, giving the root and the environment of the call.
+// The result is one of int, bool, Obj * or void, which gives ().
+//
+// The values a lambda gets as Obj * or const char * are only valid until it allocates an object:
+// take Obj ** to keep using an argument after that. Errors are reported by error(), which jumps
+// out of the lambda, so it must not have an object with a destructor alive when it calls error()
+// or anything that can allocate.
+
+#ifndef UNIOT_LISP_HPP
+#define UNIOT_LISP_HPP
+
+#include <cassert>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+#include "libminilisp.h"
+
+namespace uniot_lisp
+{
+
+// The root and the environment of the call, for the lambdas that make objects or evaluate code
+struct Context
+{
+    void *root;
+    Obj **env;
+};
+
+namespace detail
+{
+
+template <int... I>
+struct Indices
+{
+};
+
+template <int N, int... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...>
+{
+};
+
+template <int... I>
+struct MakeIndices<0, I...>
+{
+    typedef Indices<I...> type;
+};
+
+// Converts the argument in the slot to the parameter type, or reports an error.
+template <typename T>
+struct Arg;
+
+template <>
+struct Arg<int>
+{
+    static int get(const char *name, Obj **slot)
+    {
+        if (obj_type(*slot) != TINT)
+            error("%s takes only numbers", name);
+        return int_value(*slot);
+    }
+};
+
+template <>
+struct Arg<bool>
+{
+    static bool get(const char *, Obj **slot) { return *slot != Nil; }
+};
+
+template <>
+struct Arg<const char *>
+{
+    static const char *get(const char *name, Obj **slot)
+    {
+        if (obj_type(*slot) != TSYMBOL)
+            error("%s takes only symbols", name);
+        return (*slot)->name;
+    }
+};
+
+template <>
+struct Arg<Obj *>
+{
+    static Obj *get(const char *, Obj **slot) { return *slot; }
+};
+
+template <>
+struct Arg<Obj **>
+{
+    static Obj **get(const char *, Obj **slot) { return slot; }
+};
+
+// Converts the result.
+inline Obj *to_obj(void *root, int value) { return make_int(root, value); }
+inline Obj *to_obj(void *, bool value) { return value ? True : Nil; }
+inline Obj *to_obj(void *, Obj *value) { return value; }
+
+// Calls the function with the converted arguments, and converts its result.
+template <typename R>
+struct Apply
+{
+    template <typename Fn, typename... V>
+    static Obj *call(void *root, Fn fn, V... values) { return to_obj(root, fn(values...)); }
+};
+
+template <>
+struct Apply<void>
+{
+    template <typename Fn, typename... V>
+    static Obj *call(void *, Fn fn, V... values)
+    {
+        fn(values...);
+        return Nil;
+    }
+};
+
+// Calls a function of the given pointer type with the arguments in argv.
+template <typename Fn>
+struct Invoke;
+
+template <typename R, typename... A>
+struct Invoke<R (*)(A...)>
+{
+    enum { nargs = sizeof...(A) };
+
+    template <int... I>
+    static Obj *call(R (*fn)(A...), void *root, Obj **, const char *name, Obj **argv, Indices<I...>)
+    {
+        (void)name, (void)argv;
+        return Apply<R>::call(root, fn, Arg<typename std::decay<A>::type>::get(name, &argv[I])...);
+    }
+};
+
+template <typename R, typename... A>
+struct Invoke<R (*)(Context, A...)>
+{
+    enum { nargs = sizeof...(A) };
+
+    template <int... I>
+    static Obj *call(R (*fn)(Context, A...), void *root, Obj **env, const char *name, Obj **argv,
+                     Indices<I...>)
+    {
+        (void)name, (void)argv;
+        Context context = {root, env};
+        return Apply<R>::call(root, fn, context,
+                              Arg<typename std::decay<A>::type>::get(name, &argv[I])...);
+    }
+};
+
+// The builtin made for the lambda type F. A lambda expression has a type of its own, so there is
+// one per bind() in the source.
+template <typename F>
+struct Binding
+{
+    typedef decltype(+std::declval<F>()) Fn;
+    typedef Invoke<Fn> Invoker;
+
+    static Fn fn;
+    static Builtin builtin;
+
+    static Obj *thunk(void *root, Obj **env, int, Obj **argv)
+    {
+        return Invoker::call(fn, root, env, builtin.name, argv,
+                             typename MakeIndices<Invoker::nargs>::type());
+    }
+};
+
+template <typename F>
+typename Binding<F>::Fn Binding<F>::fn;
+
+template <typename F>
+Builtin Binding<F>::builtin;
+
+} // namespace detail
+
+// Adds a builtin calling the lambda, which must not capture anything. The name is kept by
+// reference, so it must outlive the interpreter, as a string literal does.
+//
+// The builtin is made once per lambda expression in the source, not once per call: a helper
+// calling bind() with the same lambda under two names would give both the second name, which its
+// errors report. Each lambda expression may be bound under one name only, and this is asserted.
+// Binding it again under the same name, as when the interpreter is created anew, is fine.
+template <typename F>
+void bind(void *root, Obj **env, const char *name, F fn)
+{
+    static_assert(std::is_class<F>::value, "bind() takes a lambda, wrap the function in one");
+    typedef detail::Binding<F> B;
+    assert((B::builtin.name == nullptr || std::strcmp(B::builtin.name, name) == 0) &&
+           "bind() called with one lambda expression under two names");
+    B::fn = +fn;
+    B::builtin.name = name;
+    B::builtin.fn = B::thunk;
+    B::builtin.min_args = B::Invoker::nargs;
+    B::builtin.max_args = B::Invoker::nargs;
+    add_builtin(root, env, &B::builtin);
+}
+
+} // namespace uniot_lisp
+
+#endif // UNIOT_LISP_HPP
@@ -20,14 +20,39 @@ function do_run() {
   fi
 }
 
-function run() {
-  echo -n "Testing $1 ... "
-  # Run the tests twice to test the garbage collector with different settings.
-  MINILISP_ALWAYS_GC= do_run "$@"
-  MINILISP_ALWAYS_GC=1 do_run "$@"
+# Prints the value of a configuration macro of libminilisp.h, with the flags repl is built with.
+function config() {
+  echo "$1" | ${CC:-cc} ${CFLAGS:--I src} -I src -x c -E -P -include libminilisp.h - | tail -1
+}
+
+function do_run_error() {
+  error=$(echo "$3" | ./repl 2>&1 > /dev/null | sed -r "s/\x1B\[([0-9]{1,2}(;[0-9]{1,2})?)?[mGK]//g" | grep -v '^$' | tail -1)
+  if [ "$error" != "$2" ]; then
+    echo FAILED
+    fail "$2 expected, but got $error"
+  fi
+}
+
+function run_with() {
+  echo -n "Testing $2 ... "
+  # Run the tests twice to test the garbage collector with different settings, and twice more with
+  # the expressions compiled to bytecode.
+  MINILISP_ALWAYS_GC= $1 "${@:2}"
+  MINILISP_ALWAYS_GC=1 $1 "${@:2}"
+  MINILISP_COMPILE=1 MINILISP_ALWAYS_GC= $1 "${@:2}"
+  MINILISP_COMPILE=1 MINILISP_ALWAYS_GC=1 $1 "${@:2}"
   echo ok
 }
 
+function run() {
+  run_with do_run "$@"
+}
+
+# Like run, but expects the last error printed
+function run_error() {
+  run_with do_run_error "$@"
+}
+
 # Basic data types
 run integer 1 1
 run integer -1 -1
@@ -71,6 +96,56 @@ run cdr "(b c)" "(cdr '(a b c))"
 
 run setcar "(x . b)" "(define obj (cons 'a 'b)) (setcar obj 'x) obj"
 
+# Vectors
+run vector '#(1 (a b) #t)' "'#(1 (a b) #t)"
+run vector '#(0 x 0)' "(define v (make-vector 3 0)) (vector-set! v 1 'x) v"
+run vector '(3 x)' "(define v (vector 1 'x 2)) (list (vector-length v) (vector-ref v 1))"
+run vector '(321)' '
+  (define v (make-vector 2000))
+  (while (< #itr 500) (vector-set! v #itr (list #itr)))
+  (gc)
+  (vector-ref v 321)'
+
+# Integer arrays
+run array '<array 1 0 3>' "(define a (make-array 3 1)) (array-set! a 1 0) (array-set! a 2 3) a"
+run array '(4 7 2 9)' "(define a (array 3 5 2 9)) (list (array-length a) (array-sum a 1 3) (array-min a) (array-max a))"
+run array '(<array 2 4> <array 4 7> 17)' "(list (array-scale (array 1 2) 2) (array-add (array 1 2) (array 3 5)) (array-dot (array 1 2) (array 3 7)))"
+run array '-2147483648' "(array-dot (array 65536 -1) (array -32768 0))"
+run array 2000 "(define a (make-array 2000 1)) (gc) (array-sum a)"
+run array '(0 0 <array> 0)' "(list (array-sum (make-array 0)) (array-sum (array 1 2) 1 1) (array-scale (make-array 0) 2) (array-dot (array) (array)))"
+run_error array 'array-min of an empty range' '(array-min (array 1 2) 1 1)'
+run array '(<array 2 2 2 2 2 2 2 2 -6> -35)' "
+  (define a (make-array 9 1)) (array-set! a 8 -3)
+  (list (array-scale a 2) (array-dot (array-scale a 7) (make-array 9 -1)))"
+run_error array 'Integer overflow' '(define a (make-array 9 1)) (array-set! a 8 2147483647) (array-add a a)'
+run_error array 'Integer overflow' '(define a (make-array 9 1)) (array-set! a 6 -1073741825) (array-scale a 2)'
+
+# Strings
+run string '"a\"b\n"' '"a\"b\n"'
+run string '(5 104 "ell" #t)' '(define s "hello") (list (string-length s) (string-ref s 0) (substring s 1 4) (string= (substring s 3) "lo"))'
+run string '#"\x00\xffA"' '(bytes 0 255 65)'
+run string '"50% done"' '"50% done"'
+run string '()' '(print "%s%s%s%s")'
+run_error string 'Malformed string->symbol' '(string->symbol "")'
+run_error string 'Malformed string->symbol' '(string->symbol "a b")'
+run string '(foo "bar" "hi")' "(list (string->symbol \"foo\") (symbol->string 'bar) (bytes->string (bytes 104 105)))"
+run string '("89ab" 56)' '
+  (define s (substring (substring "0123456789abcdef" 4 12) 4))
+  (gc)
+  (list s (string-ref s 0))'
+
+# Tables
+run table '(1 two () none)' "(define t (make-table)) (table-set! t 'a 1) (table-set! t 2 'two) (list (table-get t 'a) (table-get t 2) (table-get t 'b) (table-get t 'b 'none))"
+run table '(#t () 1 (a))' "(define t (make-table)) (table-set! t 'a 1) (table-set! t 'b 2) (list (table-del! t 'b) (table-del! t 'b) (table-count t) (table-keys t))"
+run table 200 '
+  (define t (make-table))
+  (define keys ())
+  (while (< #itr 100) (setq keys (cons (list #itr) keys)) (table-set! t (car keys) #itr) (table-set! t #itr (car keys)))
+  (gc)
+  (define n 0)
+  (while keys (if (= (table-get t (car keys)) (car (car keys))) (setq n (+ n 1))) (if (eq (table-get t (car (car keys))) (car keys)) (setq n (+ n 1))) (setq keys (cdr keys)))
+  n'
+
 # Comments
 run comment 5 "
   ; 2
@@ -81,6 +156,10 @@ run define 7 '(define x 7) x'
 run define 10 '(define x 7) (+ x 3)'
 run setq 11 '(define x 7) (setq x 11) x'
 run setq 17 '(setq + 17) +'
+run setq '(5 7)' '(define x 7) (defun f (x) (setq x 5) x) (list (f 2) x)'
+run define 4 '(defun f () (define y 3) y) (f) (define y 4) y'
+run shadow '(2 1)' '(defun h () 1) (defun k (h) (h)) (list (k (lambda () 2)) (h))'
+run shadow '(5 1)' '(define c ((lambda () (define q 5) (lambda () q)))) (define q 1) (list (c) q)'
 
 # Conditionals
 run if a "(if 1 'a)"
@@ -90,6 +169,10 @@ run if a "(if 0 'a 'b)"
 run if a "(if 'x 'a 'b)"
 run if b "(if () 'a 'b)"
 run if c "(if () 'a 'b 'c)"
+run cond b "(cond (() 'a) (1 'x 'b) (#t 'c))"
+run cond '()' "(cond (() 'a))"
+run cond 5 '(cond (() 1) (5))'
+run progn '(3 ())' '(list (progn 1 2 3) (progn))'
 
 # Logical operations
 run not \#t '(not ())'
@@ -124,6 +207,7 @@ run eq \#t "(eq 'foo 'foo)"
 run eq \#t "(eq + +)"
 run eq '()' "(eq 'foo 'bar)"
 run eq '()' "(eq + 'bar)"
+run eq \#t "(define a 'foo) (gc) (eq a 'foo)"
 
 # Other arithmetic operations
 run abs 3 '(abs -3)'
@@ -159,6 +243,40 @@ run args 15 '(defun f (x y z) (+ x y z)) (f 3 5 7)'
 run restargs '(3 5 7)' '(defun f (x . y) (cons x y)) (f 3 5 7)'
 run restargs '(3)'    '(defun f (x . y) (cons x y)) (f 3)'
 
+run builtins '(0 () (1 2 3) 6)' '(list (+) (list) (list 1 2 3) (+ 1 2 3))'
+run builtins 3 "(eval '(+ 1 2))"
+run builtins '(3 (1 . 2))' '(defun ap (f a b) (f a b)) (ap + 1 2) (list (ap + 1 2) (ap cons 1 2))'
+
+# Compiled function bodies
+run compiled '(3 1)' '(defun f (x) (if x 1 2 3)) (f ()) (list (f ()) (f #t))'
+run compiled '(5 () (1 5) #t #t #t)' "
+  (defun g (l) (list (car l) (cdr l) (cons 1 l) (eq l l) (not ()) (= 1 #t)))
+  (g '(5))
+  (g '(5))"
+run compiled 4 '(defun f (x) (+ x 1)) (f 1) (f 2) (setq + -) (f 5)'
+
+# Bytecode
+run bytecode '(10 20 1)' "
+  (defun f (n) (define s 0) (while (< #itr n) (setq s (+ s #itr))) (list s (* s 2) (% s 3)))
+  (f 5)"
+run bytecode 8 "(defun f (x) (twice x)) (defmacro twice (x) (list '+ x x)) (f 4)"
+run bytecode 2 '(defun f (x) (if x 1 2)) (setq if (lambda (c a b) b)) (f #t)'
+MINILISP_COMPILE=1 MINILISP_HEAP_SIZE=400000 run 'bytecode recursion' 1000 '
+  (defun count (n) (if (= n 0) 0 (+ 1 (count (- n 1)))))
+  (count 1000)'
+
+# Tail calls
+run 'tail call' 100000 '(defun f (n acc) (if (= n 0) acc (f (- n 1) (+ acc 1)))) (f 100000 0)'
+run 'tail call' '()' '
+  (defun even (n) (if (= n 0) #t (odd (- n 1))))
+  (defun odd (n) (if (= n 0) () (even (- n 1))))
+  (even 30001)'
+run 'tail call' 0 '(defun f (n) (if (= n 0) 0 n (f (- n 1)))) (f 50000)'
+run 'tail call' 0 "
+  (defmacro unless0 (n x) (list 'if (list '= n 0) n x))
+  (defun f (n) (unless0 n (f (- n 1))))
+  (f 50000)"
+
 # Lexical closures
 run closure 3 '(defun call (f) ((lambda (var) (f)) 5))
   ((lambda (var) (call (lambda () var))) 3)'
@@ -168,6 +286,23 @@ run counter 3 '
   (counter)
   (counter)
   (counter)'
+run closure '(3 7 9)' '
+  (defun adder (x) (lambda (y) (+ x y)))
+  (list ((adder 1) 2) ((adder 3) 4) ((adder 4) 5))'
+run closure '(21 22)' '
+  (defmacro both (f) (list (quote list) (list f 1) (list (list (quote lambda) (quote (q)) (list f 2)) 0)))
+  (defun g (x) (both (lambda (y) (+ x y))))
+  (g 10)
+  (g 20)'
+
+# Local variables
+run let 3 '(let ((a 1) (b 2)) (+ a b))'
+run let '(2 1 ())' '(let ((a 1)) (let ((a 2) (b a) c) (list a b c)))'
+run let '(6 7)' '(defun f (n) (let ((m (* n 2))) (let ((k (+ m 1))) (list m k)))) (f 3)'
+run let 12 '(defun f (n) (let ((c n)) (lambda () (setq c (+ c 1))))) (define g (f 10)) (g) (g)'
+run let 100000 '(defun f (n acc) (let ((m (- n 1))) (if (= n 0) acc (f m (+ acc 1))))) (f 100000 0)'
+run let '(5 (1 2))' "(list (let ((car 5)) car) (cons (car '(1)) '(2)))"
+run 'tail call' end "(defun f (n) (cond ((= n 0) 'end) (#t (progn n (f (- n 1)))))) (f 100000)"
 
 # While loop
 run while 45 "
@@ -176,6 +311,23 @@ run while 45 "
   (while (< i 10) (setq sum (+ sum i)) (setq i (+ i 1)))
   sum"
 
+# dotimes and dolist
+run dotimes '(45 10)' '(define s 0) (list (dotimes (i 10 s) (setq s (+ s i))) (dotimes (i 10 i)))'
+run dotimes '((1 1) (1 0) (0 1) (0 0))' '(define l ()) (dotimes (i 2) (dotimes (j 2) (setq l (cons (list i j) l)))) l'
+run dolist '(c b a)' "(define l ()) (dolist (x '(a b c) l) (setq l (cons x l)))"
+run dolist 9 "(defun f (l) (let ((s 0)) (dolist (x l s) (setq s (+ s x))))) (f '(1 2 3)) (f '(2 3 4))"
+run_error dotimes 'Maximum loop iterations (9999) exceeded. Possible infinite loop detected.' '
+  (dotimes (i 100) (dotimes (j 100)))'
+run_error dolist 'Maximum loop iterations (9999) exceeded. Possible infinite loop detected.' "
+  (dotimes (i 100) (dolist (x '(1 2 3)) (while (< #itr 40) ())))"
+
+# The native forms may not be redefined, but macros may expand into them
+run_error 'native let' 'Already defined: let' '(defmacro let (var val . body) ())'
+run_error 'native progn' 'Already defined: progn' "(defmacro progn (expr . rest) (list (cons 'lambda (cons () (cons expr rest)))))"
+run 'macro over let' 3 "
+  (defmacro my-or (expr . rest) (if rest (let ((var (gensym))) (list 'let (list (list var expr)) (list 'if var var (cons 'my-or rest)))) expr))
+  (my-or () 3)"
+
 # Macros
 run macro 42 "
   (defun lst (x . y) (cons x y))
@@ -183,6 +335,20 @@ run macro 42 "
   (if-zero 0 42)"
 
 run macro 7 '(defmacro seven () 7) ((lambda () (seven)))'
+run macro '(3 7)' "
+  (defmacro inc (v) (list 'setq v (list '+ v 1)))
+  (defun g (x) (inc x) (inc x) x)
+  (list (g 1) (g 5))"
+run macro 1 "
+  (define n 0)
+  (defmacro count () (setq n (+ n 1)) (list 'quote n))
+  (defun f () (count))
+  (f) (f) (f)"
+run defmacro-uncached 3 "
+  (define n 0)
+  (defmacro-uncached count () (setq n (+ n 1)) (list 'quote n))
+  (defun f () (count))
+  (f) (f) (f)"
 
 run macroexpand '(if (= x 0) (print x))' "
   (defun lst (x . y) (cons x y))
@@ -192,3 +358,56 @@ run macroexpand '(if (= x 0) (print x))' "
 
 # Sum from 0 to 10
 run recursion 55 '(defun f (x) (if (= x 0) 0 (+ (f (+ x -1)) x))) (f 10)'
+run 'deep recursion' 20100 '(defun f (x) (if (= x 0) 0 (+ (f (+ x -1)) x))) (f 200)'
+
+# Garbage collection
+run 'old to young' '(499 . a)' "
+  (define x (cons 1 2))
+  (while (< #itr 500) (setcar x (cons (+ #itr 0) 'a)))
+  (car x)"
+
+run promotion 299 '
+  (define l ())
+  (while (< #itr 300) (setq l (cons (+ #itr 0) l)))
+  (car l)'
+
+run 'sealed to heap' '(1 2 3)' '
+  (setq gensym (list 1 2 3))
+  (while (< #itr 400) (list 1 2 3 4))
+  gensym'
+
+# The compact references keep the heap in the block it started in, see lisp_create().
+if [ "$(config LISP_COMPACT_REFS)" != 1 ]; then
+  MINILISP_HEAP_SIZE=4000 MINILISP_HEAP_MAX_SIZE=100000 run 'growable heap' 1999 '
+    (define l ())
+    (while (< #itr 2000) (setq l (cons (+ #itr 0) l)))
+    (car l)'
+fi
+
+run 'gc deep nesting' 600 '
+  (define l 1)
+  (while (< #itr 600) (setq l (cons l (cons #itr ()))))
+  (gc)
+  (define n 0)
+  (while (not (eq l 1)) (setq n (+ n 1)) (setq l (car l)))
+  n'
+
+run gc \#t '
+  (define live (gc))
+  (define l (list 1 2 3))
+  (< live (gc))'
+run gc-stats '(minor major)' "
+  (while (< #itr 400) (list 1 2 3 4))
+  (gc)
+  (list (car (car (gc-stats))) (car (car (cdr (gc-stats)))))"
+run gc-stats \#t '
+  (define s (gc-stats))
+  (< 0 (cdr (car (cdr s))))'
+
+# Integers outside the fixnum range
+run bignum 1073741824 '(* 65536 16384)'
+run bignum 1073741823 '(- (* 65536 16384) 1)'
+run bignum -1073741825 '(- -1073741824 1)'
+run bignum 2000000000 '2000000000'
+run bignum 0 '(+ 2000000000 -2000000000)'
+run 'eq fixnum' \#t '(eq 5 5)'
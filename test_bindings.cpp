@@ -0,0 +1,135 @@
+/*
+ * This is a part of the Uniot project. The following is the user apps interpreter.
+ * Copyright (C) 2019-2020 Uniot <contact@uniot.io>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests of the C++ bindings in uniot_lisp.hpp, run by `make test` after test.sh. Each check is run
+// with and without a collection on every allocation, and with and without the bytecode compiler.
+
+#include <cstring>
+
+#include "uniot_lisp.hpp"
+
+#define HEAP_SIZE 40000
+
+static char heap[LISP_BUFFER_SIZE(HEAP_SIZE)];
+
+static void *env_constructor[3];
+static void *root = NULL;
+static Obj **genv;
+
+// The last value and the last error printed
+static char last_out[SYMBOL_MAX_LEN];
+static char last_err[SYMBOL_MAX_LEN];
+
+static int failures = 0;
+static int calls = 0;
+
+static void printOut(const char *msg, int)
+{
+  snprintf(last_out, sizeof(last_out), "%s", msg);
+}
+
+static void printErr(const char *msg, int)
+{
+  snprintf(last_err, sizeof(last_err), "%s", msg);
+}
+
+static void bindAll()
+{
+  uniot_lisp::bind(root, genv, "add", [](int a, int b) { return a + b; });
+  uniot_lisp::bind(root, genv, "positive?", [](int a) { return a > 0; });
+  uniot_lisp::bind(root, genv, "truth", [](bool b) { return b ? 1 : 0; });
+  uniot_lisp::bind(root, genv, "name-length", [](const char *name) { return (int)strlen(name); });
+  uniot_lisp::bind(root, genv, "touch", []() { calls++; });
+  uniot_lisp::bind(root, genv, "same", [](Obj *obj) { return obj; });
+  // Allocates n integers too large for a fixnum before it reads the symbol, which its root stack
+  // slot keeps alive.
+  uniot_lisp::bind(root, genv, "tag", [](uniot_lisp::Context ctx, Obj **sym, int n) {
+    for (int i = 0; i < n; i++)
+      make_int(ctx.root, 1 << 30);
+    return make_symbol(ctx.root, (*sym)->name);
+  });
+}
+
+// Evaluates the code, and compares the last value printed, or the last error if the expected value
+// starts with "error: ".
+static void check(const char *name, const char *expected, const char *code)
+{
+  printf("Testing %s ... ", name);
+  bool want_error = strncmp(expected, "error: ", 7) == 0;
+  if (want_error)
+    expected += 7;
+  bool ok = true;
+  for (int mode = 0; mode < 4; mode++)
+  {
+    always_gc = mode & 1;
+    lisp_set_compile(mode & 2);
+    last_out[0] = last_err[0] = '\0';
+    lisp_eval(root, genv, code);
+
+    const char *result = want_error || last_err[0] ? last_err : last_out;
+    if (strcmp(result, expected) != 0)
+    {
+      printf("FAILED\n\e[1;31m[ERROR]\e[0m %s expected, but got %s\n", expected, result);
+      ok = false;
+      failures++;
+    }
+  }
+  if (ok)
+    printf("ok\n");
+}
+
+int main()
+{
+  lisp_set_printers(printOut, NULL, printErr);
+
+  env_constructor[0] = root;
+  env_constructor[1] = NULL;
+  env_constructor[2] = ROOT_END;
+  root = env_constructor;
+  genv = (Obj **)(env_constructor + 1);
+
+  lisp_create_with_buffer(heap, sizeof(heap));
+  *genv = make_env(root, &Nil, &Nil);
+  define_constants(root, genv);
+  define_primitives(root, genv);
+  bindAll();
+  lisp_seal(root);
+
+  check("bind int", "5", "(add 2 3)");
+  check("bind int", "-1073741825", "(add -1073741824 -1)");
+  check("bind bool", "(#t ())", "(list (positive? 3) (positive? -3))");
+  check("bind bool", "(1 0 1)", "(list (truth 'a) (truth ()) (truth 0))");
+  check("bind const char *", "5", "(name-length 'hello)");
+  check("bind void", "(() 4)", "(list (touch) (progn (touch) (touch) (touch) 4))");
+  check("bind Obj *", "(a b)", "(same '(a b))");
+  check("bind Context", "x", "(tag 'x 2)");
+  check("bind in a function", "10", "((lambda (x) (add x x)) 5)");
+  check("bind arity", "error: Malformed add", "(add 1)");
+  check("bind arity", "error: Malformed touch", "(touch 1)");
+  check("bind type", "error: add takes only numbers", "(add 1 'a)");
+  check("bind type", "error: name-length takes only symbols", "(name-length 5)");
+
+  if (calls != 16)
+  {
+    printf("\e[1;31m[ERROR]\e[0m touch called %d times instead of 16\n", calls);
+    failures++;
+  }
+
+  lisp_destroy();
+  return failures ? 1 : 0;
+}
@@ -174,11 +174,18 @@ void js_handle_state_task(int times, int ms, int pass)
     js_handle_state(buf);
 }
 
+static void set_pass(void *root, struct Obj **t_pass, int value)
+{
+    Obj *val = make_int(root, value);
+    SET_CDR(*t_pass, val);
+    write_barrier(*t_pass, val);
+}
+
 static void attach_task(void *root, struct Obj **env, int ms, int times)
 {
     DEFINE2(t_obj, t_pass);
     *t_pass = get_variable(root, env, "#t_pass");
-    *t_obj = get_variable(root, env, "#t_obj")->cdr;
+    *t_obj = CDR(get_variable(root, env, "#t_obj"));
 
     if (times > 0)
     {
@@ -190,14 +197,14 @@ static void attach_task(void *root, struct Obj **env, int ms, int times)
                 break;
             }
             // TODO: disallow endless loops
-            (*t_pass)->cdr->value = t;
+            set_pass(root, t_pass, t);
             eval(root, env, t_obj);
             js_handle_state_task(times, ms, t);
         }
     }
     else
     {
-        (*t_pass)->cdr->value = -1;
+        set_pass(root, t_pass, -1);
         for (int t = global_task_limiter; t >= 0; --t)
         {
             if (global_task_terminator) {
@@ -215,18 +222,19 @@ static struct Obj *prim_task(void *root, struct Obj **env, struct Obj **list)
     if (length(args) != 3)
         error("Malformed task");
 
-    Obj *times = args->car;
-    Obj *ms = args->cdr->car;
-    Obj *obj = args->cdr->cdr->car;
+    Obj *times = CAR(args);
+    Obj *ms = CAR(CDR(args));
+    Obj *obj = CAR(CDR(CDR(args)));
 
-    if (times->type != TINT || ms->type != TINT || obj->type != TCELL)
+    if (obj_type(times) != TINT || obj_type(ms) != TINT || obj_type(obj) != TCELL)
         error("Task expects (times ms obj) with (Int Int Cell) types");
 
     DEFINE1(t_obj);
     *t_obj = get_variable(root, env, "#t_obj");
-    (*t_obj)->cdr = obj;
+    SET_CDR(*t_obj, obj);
+    write_barrier(*t_obj, obj);
 
-    attach_task(root, env, ms->value, times->value);
+    attach_task(root, env, int_value(ms), int_value(times));
     return True;
 }
 
@@ -249,7 +257,7 @@ static struct Obj *prim_tojs(void *root, struct Obj **env, struct Obj **list)
         if (strcmp(result, "()") == 0) {
             return Nil;
         }
-        return make_symbol(root, result);
+        return make_string(root, result, strlen(result));
     }
     return make_int(root, int_result);
 }
@@ -275,7 +283,7 @@ static bool lisp_shoot_once(size_t max_heap, const char *library, const char *in
     void *root = NULL;
     DEFINE1(env);
 
-    lisp_create(max_heap);
+    lisp_create(max_heap, max_heap);
 
     *env = make_env(root, &Nil, &Nil);
     define_constants(root, env);
@@ -287,6 +295,7 @@ static bool lisp_shoot_once(size_t max_heap, const char *library, const char *in
     mem_used_init = lisp_mem_used();
     // lisp_set_printers(NULL, NULL, NULL);
     lisp_eval(root, env, library);
+    lisp_seal(root);
     mem_used_by_library = lisp_mem_used();
     lisp_set_printers(print_out, NULL, print_err);
     bool success = lisp_eval(root, env, input);